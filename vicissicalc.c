@@ -1,10 +1,37 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+
+#ifdef COUNT_ALLOCATIONS
+// For ./bench: count allocations (not thread-safely).
+static unsigned long nallocations;
+static void *counted(void *p) { ++nallocations; return p; }
+#define malloc(size)          counted(malloc(size))
+#define calloc(n, size)       counted(calloc(n, size))
+#define realloc(p, size)      counted(realloc(p, size))
+#else
+static const unsigned long nallocations = 0;
+#endif
 
 
 // ANSI screen output
@@ -13,16 +40,13 @@
 
 #define HOME             ANSI "H"
 #define CLEAR_LINE_RIGHT ANSI "K"
-#define CLEAR_TO_BOTTOM  ANSI "J"
 #define CLEAR_SCREEN     ANSI "2J" HOME
 #define HIDE_CURSOR      ANSI "?25l"
 #define SHOW_CURSOR      ANSI "?25h"
-#define NEWLINE          CLEAR_LINE_RIGHT "\r\n"
+#define BRACKETED_PASTE_ON  ANSI "?2004h"
+#define BRACKETED_PASTE_OFF ANSI "?2004l"
 
-static void screen_reset(void) { printf("\x1b" "c"); fflush(stdout); }
-
-static void set_foreground(unsigned color) { printf(ANSI "%um", 30 + color); }
-static void set_background(unsigned color) { printf(ANSI "%um", 40 + color); }
+static void screen_reset(void) { printf(BRACKETED_PASTE_OFF "\x1b" "c"); fflush(stdout); }
 
 // Colors. This is a macro for the sake of use in constant expressions:
 #define bright(color)   (60 + (color))  
@@ -40,8 +64,58 @@ enum {
 
 // Keyboard input
 
+// Our terminal settings are like `stty raw -echo`.
+static struct termios cooked;  // The settings from before, to restore,
+static int cooked_saved;       //  if we saved them.
+
+static void raw_mode(void) {
+    if (tcgetattr(STDIN_FILENO, &cooked) < 0) return;  // Not a terminal.
+    cooked_saved = 1;
+    struct termios raw = cooked;
+    raw.c_iflag &= ~(IGNBRK | BRKINT | IGNPAR | PARMRK | INPCK | ISTRIP
+                     | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+    raw.c_oflag &= ~OPOST;
+    raw.c_lflag &= ~(ICANON | ISIG | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+}
+
+static void cooked_mode(void) {
+    if (cooked_saved) tcsetattr(STDIN_FILENO, TCSANOW, &cooked);
+}
+
+// Input comes in with one read() of all that's there, into this buffer,
+// and then we decode keys out of it.
+static unsigned char input_bytes[4096];
+static unsigned input_start, input_end;  // The bytes not decoded yet.
+
+enum { incomplete = -2 };  // What we get peeking at half a key.
+
+// Return the byte `*at` bytes past input_start, and advance *at. If
+// that's not been read yet, read more, unless we mustn't `block`.
+static int next_byte(unsigned *at, int block) {
+    if (input_start + *at == input_end) {
+        if (!block) return incomplete;
+        memmove(input_bytes, input_bytes + input_start,
+                input_end - input_start);
+        input_end -= input_start;
+        input_start = 0;
+        ssize_t n;
+        do {
+            n = read(STDIN_FILENO, input_bytes + input_end,
+                     sizeof input_bytes - input_end);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return EOF;
+        input_end += n;
+    }
+    return input_bytes[input_start + (*at)++];
+}
+
 // Just making up our own coding for non-ASCII keys. k is an input byte:
 #define nonascii(k) (256 + 8 * (k))
+// Or for keys sent as esc [ m ~, m is their number:
+#define tilde_key(m) nonascii(256 + (m))
 
 enum {
     esc       = 27,
@@ -51,62 +125,113 @@ enum {
     key_left  = nonascii('D'),
     key_weirdo = nonascii(256), // Some keycode we didn't understand
 
+    max_tilde = 255,  // The most m we'll take in a tilde_key().
+    key_page_up   = tilde_key(5),
+    key_page_down = tilde_key(6),
+    key_paste     = tilde_key(200), // Pasted text follows, up to paste_end.
+
     key_shift = 1<<0, // Key-chord modifiers go in the low 3 bits of our code
     key_alt   = 1<<1,
     key_ctrl  = 1<<2,
 };
 
-// N.B. here we've thrown away the m/n bits if there were any.
-// TODO preserve all the info even for keys we don't understand.
 static int weirdo(int last_keycode) {
-    return last_keycode == EOF ? EOF : key_weirdo;
+    return last_keycode == EOF || last_keycode == incomplete
+        ? last_keycode : key_weirdo;
 }
 
 // Turn an input escape sequence into our own encoding of a keychord.
-// m1 and n1 are from the sequence's optional modifier prefix.
+// m1 and n1 are from the sequence's optional parameters: for a key
+// like an arrow, m1 is 1 and n1 sets the modifiers; for a key ending
+// in '~', m1 says which key it is.
 static int chord(int m1, int n1, int key) {
-    if (!(1 <= m1 && m1 <= 8 && 1 <= n1 && n1 <= 8))
+    if (!(1 <= n1 && n1 <= 8))
         return weirdo(key);
-    int m_bits = m1-1, n_bits = n1-1;
-    if (m_bits != 0) return weirdo(key); // I dunno the meaning of nondefault m
-    if (n_bits != (n_bits & 7)) return weirdo(key);
+    int n_bits = n1-1;
+    if (key == '~')
+        return m1 <= max_tilde ? tilde_key(m1) | n_bits : weirdo(key);
+    if (m1 != 1) return weirdo(key); // I dunno the meaning of nondefault m
     // TODO for the Home key this would need adjustment:
     return nonascii(key) | n_bits;
 }
 
-static int get_key(void) {
-    int k0 = getchar();
+// Scan a decimal parameter of an escape sequence, starting with the
+// digit in *k, and leave in *k the byte after it.
+static int parameter(int *k, unsigned *at, int block) {
+    int n = 0;
+    for (; isdigit(*k); *k = next_byte(at, block))
+        if (n < 1000) n = 10 * n + (*k - '0');
+    return n;
+}
+
+// Decode the next key, from *at bytes into the input.
+static int decode_key(unsigned *at, int block) {
+    int k0 = next_byte(at, block);
     if (k0 != esc) return k0;
     // We just saw the start of an esc sequence. N.B. we can't tell if
-    // a bare esc key was hit by the user. We could guess it was, if
-    // we were to block on reading the next byte, but that behavior
-    // doesn't seem to be 100% correlated with that keyboard event,
-    // and we'd need underlying OS functions in place of getchar(). So
-    // we don't even try: this program doesn't use the bare esc key
-    // for anything.
-    int k1 = getchar();
+    // a bare esc key was hit by the user. We could guess it was, if it
+    // came with no more bytes, but that behavior doesn't seem to be
+    // 100% correlated with that keyboard event. So we don't even try:
+    // this program doesn't use the bare esc key for anything.
+    int k1 = next_byte(at, block);
+    if (k1 == 'O') {  // An arrow key in the terminal's "application mode".
+        int k = next_byte(at, block);
+        return k < 0 ? k : nonascii(k);
+    }
     if (k1 != '[') return weirdo(k1);
     // This started a sequence like
-    //   esc, '[', optional(digit, optional(';', digit)), character.
-    // Call the digits `m1` and `n1`; they default to 1.
+    //   esc, '[', optional(digits, optional(';', digits)), character.
+    // Call the numbers `m1` and `n1`; they default to 1.
     int m1 = 1, n1 = 1;
-    int k = getchar();
+    int k = next_byte(at, block);
     if (isdigit(k)) {
-        m1 = k - '0'; k = getchar();
+        m1 = parameter(&k, at, block);
         if (k == ';') {
-            k = getchar();
+            k = next_byte(at, block);
             if (!isdigit(k)) return weirdo(k);
-            n1 = k - '0'; k = getchar();
+            n1 = parameter(&k, at, block);
         }
     }
+    if (k < 0) return k;
     return chord(m1, n1, k); // k being the last byte of the above sequence
 }
 
+static int get_key(void) {
+    unsigned at = 0;
+    int key = decode_key(&at, 1);
+    input_start += at;
+    return key;
+}
+
+// Return true if a key gets hit within `ms` milliseconds (or already
+// was, and awaits decoding).
+static int key_waiting(int ms) {
+    if (input_start < input_end) return 1;
+    struct pollfd in = { .fd = STDIN_FILENO, .events = POLLIN };
+    return 0 != poll(&in, 1, ms);
+}
+
+// Return the next byte of input, unlike get_key() not decoding it.
+static int get_byte(void) {
+    unsigned at = 0;
+    int byte = next_byte(&at, 1);
+    input_start += at;
+    return byte;
+}
+
+// Return the next key if it's all come in already, else `incomplete`.
+static int peek_key(void) {
+    unsigned at = 0;
+    return decode_key(&at, 0);
+}
+
 
  // Utilities
 
+static int raw_terminal;  // Whether we've taken over the terminal.
+
 static void panic(const char *plaint) {
-    system("stty sane"); screen_reset();
+    if (raw_terminal) { cooked_mode(); screen_reset(); }
     fprintf(stderr, "%s\n", plaint);
     exit(1);
 }
@@ -121,14 +246,33 @@ static void stuff(char *dest, size_t dest_size, const char *s) {
     dest[i] = 0;
 }
 
-// Really strdup, but that name may be taken.
-static char *dupe(const char *s) {
-    char *result = malloc(strlen(s) + 1);
+// Return `array`, of *capacity elements of `size` bytes each, enlarged
+// if need be to hold at least `needed` elements. (It's malloced or NULL.)
+static void *grow(void *array, unsigned *capacity, unsigned needed,
+                  size_t size) {
+    if (needed <= *capacity) return array;
+    unsigned n = *capacity ? *capacity : 4;
+    while (n < needed) n *= 2;
+    array = realloc(array, n * size);
+    if (!array) panic("Out of memory");
+    *capacity = n;
+    return array;
+}
+
+// Return a malloced, null-terminated copy of the n bytes at s.
+static char *dupe_bytes(const char *s, size_t n) {
+    char *result = malloc(n + 1);
     if (!result) panic("Out of memory");
-    strcpy(result, s);
+    memcpy(result, s, n);
+    result[n] = '\0';
     return result;
 }
 
+// Really strdup, but that name may be taken.
+static char *dupe(const char *s) {
+    return dupe_bytes(s, strlen(s));
+}
+
 static const char *skip_blanks(const char *s) {
     return s + strspn(s, " \t\r\n\f\v");
 }
@@ -140,389 +284,5594 @@ static const char *orelse(const char *s1, const char *s2) {
 static int min(int x, int y) { return x < y ? x : y; }
 static int max(int x, int y) { return x > y ? x : y; }
 
+// A growable buffer of bytes.
+typedef struct Buffer Buffer;
+struct Buffer {
+    char *chars;         // malloced
+    unsigned n, capacity;
+};
 
-// Evaluating cell formulas (called 'expressions' here)
+static void put_bytes(Buffer *b, const char *bytes, size_t n) {
+    b->chars = grow(b->chars, &b->capacity, b->n + n + 1, 1);
+    memcpy(b->chars + b->n, bytes, n);
+    b->n += n;
+    b->chars[b->n] = '\0';
+}
 
-typedef double Value;
+static void put_format(Buffer *b, const char *format, ...) {
+    char text[1024];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof text, format, args);
+    va_end(args);
+    if (0 < n) put_bytes(b, text, min(n, sizeof text - 1));
+}
 
-typedef struct Evaluator Evaluator;
-struct Evaluator {
-    unsigned row, col;   // Which cell we're evaluating.
-    int token;           // The kind of lexical token we just scanned.
-    Value token_value;   //   Its value, if any.
-    const char *s;       // The rest of the expression to scan.
-    const char *plaint;  // The first error message; NULL if none yet.
+
+// Profiling: where the time goes
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int profiling;  // Whether to time each cell's evaluation.
+
+typedef struct Profile Profile;
+struct Profile {
+    unsigned long evals;   // Since the last edit: cells evaluated,
+    unsigned long refs;    //  and the references they made.
+    double frame_time;     // The last frame: how long it took to show,
+    size_t frame_bytes;    //  and how many bytes it sent.
 };
+static Profile profile;
 
-static void fail(Evaluator *e, const char *plaint) {
-    if (e->plaint == NULL) {
-        // On the first failure, skip right to the end of the expression,
-        // making finishing the parsing effectively a no-op.
-        e->plaint = plaint;
-        e->s += strlen(e->s);
-    }
+
+// Drawing on the screen, a frame at a time
+
+// We draw each frame into a buffer, then send the terminal only what
+// differs from the last frame, in one write(). 
+
+typedef struct Colors Colors;
+struct Colors {
+    unsigned fg, bg;
+};
+
+typedef struct Glyph Glyph;
+struct Glyph {
+    char ch;
+    unsigned char fg, bg;
+};
+
+static unsigned screen_width, screen_height;  // Set by size_screen().
+static unsigned plaint_line;  // Where messages and input go: the bottom.
+
+static Glyph *frame;          // Being drawn, screen_height x screen_width.
+static Glyph *shown;          // On the terminal,
+static char *line_known;      //  where known.
+static Colors pen;                    // The colors we're drawing in,
+static unsigned pen_x, pen_y;         //  and where.
+
+static void set_color(Colors colors) {
+    pen = colors;
 }
 
-// Scan the next lexical token, and advance past it.
-static void lex(Evaluator *e) {
-    e->s = skip_blanks(e->s);
-    if (*e->s == '\0')
-        e->token = 0;   // (token 0 means end of input)
-    else if (isdigit(*e->s)) {
-        char *endptr;
-        e->token = '0'; // (meaning a number)
-        e->token_value = strtod(e->s, &endptr);
-        e->s = endptr; // grumble: you can't just pass &e->s above
-    }
-    else if (strchr("+-*/%^@cr()", *e->s))
-        e->token = *e->s++;
-    else {
-        fail(e, "Syntax error: unknown token type");
-        e->token = 0;
-    }
+static void move_pen(unsigned x, unsigned y) {
+    pen_x = x;
+    pen_y = y;
 }
 
-// These parser functions also evaluate as they parse, and return the value.
-static Value parse_expr(Evaluator *e, int precedence);
+// Draw text at the pen, clipped to the screen edge.
+static void draw_text(const char *s) {
+    for (; *s && pen_x < screen_width; ++s, ++pen_x)
+        frame[pen_y * screen_width + pen_x] = (Glyph) {
+            .ch = isprint((unsigned char) *s) ? *s : ' ',
+            .fg = pen.fg, .bg = pen.bg
+        };
+}
 
-static Value parse_factor(Evaluator *e) {
-    Value v = e->token_value;
-    switch (e->token) {
-        case '0': lex(e); return v;
-        case '-': lex(e); return -parse_factor(e);
-        case 'c': lex(e); return e->col;
-        case 'r': lex(e); return e->row;
-        case '(':
-            lex(e); 
-            v = parse_expr(e, 0);
-            if (e->token != ')')
-                fail(e, "Syntax error: expected ')'");
-            lex(e);
-            return v;
-        default:
-            fail(e, "Syntax error: expected a factor");
-            lex(e);
-            return 0;
-    }
+// Draw formatted text likewise.
+static void draw(const char *format, ...) {
+    char text[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof text, format, args);
+    va_end(args);
+    draw_text(text);
 }
 
-static Value zero_divide(Evaluator *e) {
-    fail(e, "Divide by 0");
-    return 0;
+// Blank the rest of the line in the current colors, like
+// CLEAR_LINE_RIGHT, and move to the start of the next.
+static void end_line(void) {
+    while (pen_x < screen_width) draw(" ");
+    move_pen(0, pen_y + 1);
 }
 
-static Value refer(Evaluator *e, Value r, Value c);
+// Note that the terminal's line y got written on behind our backs.
+static void forget_line(unsigned y) {
+    line_known[y] = 0;
+}
 
-static Value apply(Evaluator *e, int rator, Value lhs, Value rhs) {
-    switch (rator) {
-        case '+': return lhs + rhs;
-        case '-': return lhs - rhs;
-        case '*': return lhs * rhs;
-        case '/': return rhs == 0 ? zero_divide(e) : lhs / rhs;
-        case '%': return rhs == 0 ? zero_divide(e) : fmod(lhs, rhs);
-        case '^': return pow(lhs, rhs); // XXX report domain errors
-        case '@': return refer(e, lhs, rhs);
-        default: assert(0); return 0;
+// Fit the frame to the terminal, if it's changed size. When we can't
+// tell, assume the classic 80x24.
+static void size_screen(void) {
+    unsigned width = 80, height = 24;
+    struct winsize size;
+    if (0 == ioctl(STDOUT_FILENO, TIOCGWINSZ, &size)
+        && 0 < size.ws_col && 0 < size.ws_row) {
+        width = size.ws_col;
+        height = size.ws_row;
     }
+    if (frame && width == screen_width && height == screen_height)
+        return;
+    screen_width = width;
+    screen_height = height;
+    plaint_line = height - 1;
+    free(frame); free(shown); free(line_known);
+    frame      = calloc(width * height, sizeof frame[0]);
+    shown      = calloc(width * height, sizeof shown[0]);
+    line_known = calloc(height, sizeof line_known[0]);
+    if (!frame || !shown || !line_known) panic("Out of memory");
+    fputs(CLEAR_SCREEN, stdout);
 }
 
-// Parse an infix subexpression, in the right-context of an operator
-// binding of tightness `precedence` (lower numbers meaning less tightly).
-// (This method is called precedence-climbing.)
-static Value parse_expr(Evaluator *e, int precedence) {
-    Value lhs = parse_factor(e); // left-hand side of a potentially infix expr
-    for (;;) {
-        int lp, rp, rator = e->token;  // left/right precedence and operator
-        switch (rator) {
-            case '+': lp = 1; rp = 2; break;
-            case '-': lp = 1; rp = 2; break;
-            case '*': lp = 3; rp = 4; break;
-            case '/': lp = 3; rp = 4; break;
-            case '%': lp = 3; rp = 4; break;
-            case '^': lp = 5; rp = 5; break;
-            case '@': lp = 7; rp = 8; break;
-            default: return lhs;
+// Send the frame's changes to the terminal, leaving its cursor at the
+// start of the plaint line.
+static void flush_frame(void) {
+    static Buffer out;
+    out.n = 0;
+    int x = -1, y = -1;         // The terminal's cursor, if known;
+    int fg = -1, bg = -1;       //  and its colors.
+    for (int j = 0; j < (int) screen_height; ++j) {
+        for (int i = 0; i < (int) screen_width; ++i) {
+            Glyph g = frame[j * screen_width + i];
+            if (line_known[j] && 0 == memcmp(&g, &shown[j * screen_width + i],
+                                             sizeof g))
+                continue;
+            if (x != i || y != j)
+                put_format(&out, ANSI "%d;%dH", j+1, i+1);
+            if (fg != g.fg || bg != g.bg)
+                put_format(&out, ANSI "%u;%um", 40 + g.bg, 30 + g.fg);
+            put_bytes(&out, &g.ch, 1);
+            shown[j * screen_width + i] = g;
+            x = i + 1; y = j; fg = g.fg; bg = g.bg;
         }
-        if (lp < precedence) return lhs;
-        lex(e);
-        lhs = apply(e, rator, lhs, parse_expr(e, rp));
+        line_known[j] = 1;
+    }
+    // Leave the terminal ready to echo input on the plaint line.
+    Glyph g = frame[plaint_line * screen_width];
+    if (x != 0 || y != (int) plaint_line)
+        put_format(&out, ANSI "%d;1H", plaint_line + 1);
+    if (fg != g.fg || bg != g.bg)
+        put_format(&out, ANSI "%u;%um", 40 + g.bg, 30 + g.fg);
+    profile.frame_bytes = out.n;
+    fflush(stdout);
+    for (size_t sent = 0; sent < out.n; ) {
+        ssize_t n = write(STDOUT_FILENO, out.chars + sent, out.n - sent);
+        if (n < 0 && errno != EINTR) break;
+        if (0 < n) sent += n;
     }
 }
 
-// Evaluate a complete formula.
-static const char *evaluate(Value *result, Evaluator *e) {
-    lex(e);
-    *result = parse_expr(e, 0);
-    if (e->token != 0) fail(e, "Syntax error: unexpected token");
-    return e->plaint;
-}
-
-
-// The array of spreadsheet cells
 
-static const char *the_plaint = NULL;
+// Numbers
 
-static void oops(const char *plaint) {
-    if (!the_plaint)
-        the_plaint = plaint;
-}
+// Values are double-precision floating point; or built with -DDECIMAL,
+// decimal fixed point: a count of millionths, in 64 bits. Then sums of
+// money come out exact, to the cent, where binary fractions can be off
+// by a hair; in exchange, a result beyond about 9.2e12 is an error.
+#ifdef DECIMAL
 
-typedef struct Cell Cell;
-struct Cell {
-    char *text;          // malloced
-    const char *plaint;  // in static memory
-    Value value;         // valid if plaint is NULL
-};
+typedef int64_t Value;
+__extension__ typedef __int128 Wide;   // For the steps that can't overflow.
+typedef Wide Sum;       // A sum of many values.
 
-// These other states for a cell's plaint have special meaning:
-static const char stale[] = "Stale"; // N.B. never seen in the UI.
-static const char cycle[] = "Cycle";
-static const char no_formula[] = "No value for referred cell";
+enum { decimal_places = 6 };
+#define ONE ((Value) 1000000)
 
-enum { nrows = 20, ncols = 4 };
-static Cell cells[nrows][ncols];
+// An outcome out of range: no value can be this.
+#define overflowed INT64_MIN
+#define max_value INT64_MAX
 
-// Invalidate any cached cell values, because a formula might have changed.
-static void text_updated(void) {
-    for (unsigned r = 0; r < nrows; ++r)
-        for (unsigned c = 0; c < ncols; ++c)
-            cells[r][c].plaint = stale;
-}
+static Value from_integer(long long n) { return n * ONE; }
+static long long to_integer(Value v)  { return v / ONE; }
+static int is_integer(Value v)         { return v % ONE == 0; }
 
-static void set_up(void) {
-    for (unsigned r = 0; r < nrows; ++r)
-        for (unsigned c = 0; c < ncols; ++c)
-            cells[r][c].text = dupe("");
-    text_updated();
+static Value narrow(Wide n) {
+    return n <= overflowed || max_value < n ? overflowed : (Value) n;
 }
 
-// (You should use set_text() by default; set_text_only() is for when
-// you want to amortize text_updated() over a whole batch of changes.)
-static void set_text_only(unsigned row, unsigned col, const char *text) {
-    assert(row < nrows && col < ncols);
-    if (cells[row][col].text == text) return;
-    free(cells[row][col].text);
-    cells[row][col].text = dupe(text);
+// n/d, rounded to the nearest, with halves away from 0.
+static Value divide_rounded(int64_t n, int64_t d) {
+    int64_t q = n / d, r = n % d;
+    int64_t ar = r < 0 ? -r : r, ad = d < 0 ? -d : d;
+    if (ad - ar <= ar) q += (n < 0) == (d < 0) ? 1 : -1;
+    return q;
 }
 
-static void set_text(unsigned row, unsigned col, const char *text) {
-    set_text_only(row, col, text);
-    text_updated();
+// The same, for when n may be too big for 64 bits.
+static Value divide_wide(Wide n, Wide d) {
+    Wide q = n / d, r = n % d;
+    Wide ar = r < 0 ? -r : r, ad = d < 0 ? -d : d;
+    if (ad - ar <= ar) q += (n < 0) == (d < 0) ? 1 : -1;
+    return narrow(q);
 }
 
-// A formula, if it's given, follows the '=' prefix.
-static const char *find_formula(const char *s) {
-    const char *t = skip_blanks(s);
-    return *t == '=' ? t + 1 : NULL;
+static Value multiply(Value x, Value y) {
+    int64_t product;
+    if (!__builtin_mul_overflow(x, y, &product))
+        return divide_rounded(product, ONE);
+    return divide_wide((Wide) x * y, ONE);
 }
 
-// Reevaluate the cell at (r,c).
-static void recalculate(unsigned r, unsigned c) {
-    assert(r < nrows && c < ncols);
-    Cell *cell = &cells[r][c];
-    const char *formula = find_formula(cell->text);
-    Evaluator evaluator = {.row = r, .col = c, .s = formula, .plaint = NULL};
-    cell->plaint = cycle; // Provisionally.
-    cell->plaint = !formula ? no_formula : evaluate(&cell->value, &evaluator);
-    oops(cell->plaint);
+// (y must be nonzero.)
+static Value divide(Value x, Value y) {
+    int64_t scaled;
+    if (!__builtin_mul_overflow(x, ONE, &scaled))
+        return divide_rounded(scaled, y);
+    return divide_wide((Wide) x * ONE, y);
 }
 
-// Set *value to the value of the cell at (r,c), unless computing it
-// yields an error. Return the plaint.
-static const char *get_value(Value *value, unsigned r, unsigned c) {
-    if (nrows <= r || ncols <= c)
-        return "Cell out of range";
-    Cell *cell = &cells[r][c];
-    if (cell->plaint == stale) recalculate(r, c);
-    if (!cell->plaint) *value = cell->value;
-    return cell->plaint;
+static Value from_double(double d) {
+    d *= ONE;
+    return -9.2e18 < d && d < 9.2e18 ? (Value) llround(d) : overflowed;
 }
 
-// The `r@c` operation in expressions, for row r, column c.
-static Value refer(Evaluator *e, Value r, Value c) {
-    if (r != (int)r || c != (int)c) {
-        fail(e, "Non-integer cell coordinate");
-        return 0;
+// A whole power goes by repeated squaring, rounding at each step;
+// any other, through floating point.
+static Value power(Value x, Value y) {
+    if (!is_integer(y))
+        return from_double(pow((double) x / ONE, (double) y / ONE));
+    long long n = to_integer(y);
+    unsigned long long m = n < 0 ? -(unsigned long long) n
+                                   : (unsigned long long) n;
+    Value result = ONE;
+    for (; m; m >>= 1) {
+        if (m & 1) result = multiply(result, x);
+        if (result == overflowed) return overflowed;
+        if (1 < m && (x = multiply(x, x)) == overflowed) return overflowed;
     }
-    Value value = 0;
-    const char *plaint = get_value(&value, (int)r, (int)c);
-    if (plaint && plaint != no_formula && plaint != cycle) plaint = "";
-    if (plaint) fail(e, plaint);
-    // A plaint of "" is for when there's an error at the other end of
-    // the reference, but we don't want to redundantly report it here,
-    // ('here' meaning for the cell making the reference to the other
-    // cell) since the same plaint already shows over there in the
-    // cell-to-blame. The "Cycle" case propagates through because we
-    // don't track *who* to blame for a cycle.
-    return value;
+    if (n < 0) return result == 0 ? overflowed : divide(ONE, result);
+    return result;
 }
 
-
-// Entering or editing a line of text
-
-static char input[81];
-
-// Return true iff the user commits a change.
-static int edit_input(void) {
-    size_t p = strlen(input);
-    for (;;) {
-        printf("\r" CLEAR_LINE_RIGHT "? %s" SHOW_CURSOR, input); fflush(stdout);
-        int key = get_key();
-        printf(HIDE_CURSOR);
-        if (key == '\r' || key == EOF)
-            return 1;
-        else if (key == 7) // ctrl-G to abort
-            return 0;
-        else if (key == '\b' || key == 127) { // backspace
-            if (0 < p)
-                input[--p] = '\0';
-        }
-        else if (isprint(key) && p+1 < sizeof input) {
-            input[p++] = key;
-            input[p] = '\0';
-            putchar(key); fflush(stdout);
+// Scan a number at s, like strtod() without the hex and such, but to
+// the nearest millionth exactly. Set *end to just after it.
+static Value scan_value(const char *s, char **end) {
+    Wide digits = 0;
+    int exponent = decimal_places, any = 0;
+    for (; isdigit(*s); ++s, any = 1)
+        if (digits < (Wide) 1 << 100) digits = 10 * digits + (*s - '0');
+        else ++exponent;
+    if (*s == '.')
+        for (++s; isdigit(*s); ++s, any = 1)
+            if (digits < (Wide) 1 << 100) {
+                digits = 10 * digits + (*s - '0');
+                --exponent;
+            }
+    if (any && (*s == 'e' || *s == 'E')) {
+        const char *p = s + 1;
+        int sign = *p == '-' ? -1 : 1;
+        if (*p == '-' || *p == '+') ++p;
+        if (isdigit(*p)) {
+            int n = 0;
+            for (; isdigit(*p); ++p)
+                if (n < 1000) n = 10 * n + (*p - '0');
+            exponent += sign * n;
+            s = p;
         }
     }
+    *end = (char *) s;
+    if (digits == 0) return 0;
+    for (; 0 < exponent; --exponent)
+        if (max_value < (digits *= 10)) return overflowed;
+    Wide scale = 1;
+    for (; exponent < 0 && scale <= digits; ++exponent)
+        scale *= 10;
+    return exponent < 0 ? 0 : divide_wide(digits, scale);
 }
 
+// Format v in `size` bytes at `text`, exactly.
+static void show_value(char *text, size_t size, Value v, int digits) {
+    (void) digits;
+    unsigned long long magnitude = v < 0 ? -(unsigned long long) v
+                                          : (unsigned long long) v;
+    unsigned long long fraction = magnitude % ONE;
+    int places = decimal_places;
+    for (; places && fraction % 10 == 0; --places)
+        fraction /= 10;
+    if (places)
+        snprintf(text, size, "%s%llu.%0*llu", v < 0 ? "-" : "",
+                 magnitude / ONE, places, fraction);
+    else
+        snprintf(text, size, "%s%llu", v < 0 ? "-" : "", magnitude / ONE);
+}
 
-// Loading and saving of files
+#else
 
-static FILE *open_file(const char *filename, const char *mode,
-                       const char *plaint) {
-    FILE *file = fopen(filename, mode);
-    if (!file) oops(orelse(plaint, strerror(errno)));
-    return file;
-}
+typedef double Value;
+typedef double Sum;
 
-static char spreadsheet_filename[1024]; // (wish I could use PATH_MAX)
+enum { decimal_places = 0 };
 
-static void write_file(void) {
-    stuff(input, sizeof input, spreadsheet_filename);
-    if (!edit_input()) {
-        oops("Aborted");
-        return;
-    }
-    stuff(spreadsheet_filename, sizeof spreadsheet_filename, input);
+// Nothing overflows in floating point: so no value can equal this, it
+// being no number.
+#define overflowed NAN
+#define max_value HUGE_VAL
 
-    FILE *file = open_file(spreadsheet_filename, "w", NULL);
-    if (!file) return;
-    for (unsigned r = 0; r < nrows; ++r)
-        for (unsigned c = 0; c < ncols; ++c) {
-            const char *text = cells[r][c].text;
-            if (*skip_blanks(text))
-                fprintf(file, "%u %u %s\n", r, c, text);
-        }
-    fclose(file);
-    oops("File written"); // (The message is not really an oops, though.)
+static Value from_integer(long long n) { return n; }
+static long long to_integer(Value v)  { return v; }
+static int is_integer(Value v)         { return v == floor(v); }
+static Value narrow(Sum n)             { return n; }
+
+static Value scan_value(const char *s, char **end) {
+    return strtod(s, end);
 }
 
-static void read_file(void) {
-    assert(*spreadsheet_filename); // Should be nonempty if we get here.
-    FILE *file = open_file(spreadsheet_filename, "r", "Fresh file");
-    if (!file) return;
-    char line[1024];
-    while (fgets(line, sizeof line, file)) {
-        unsigned r, c;
-        char text[sizeof line];
-        if (3 != sscanf(line, "%u %u %[^\n]", &r, &c, text))
-            oops("Bad line in file");
-        else if (nrows <= r || ncols <= c)
-            oops("Row or column number out of range in file");
-        else
-            set_text_only(r, c, text);
-    }
-    text_updated();
-    fclose(file);
+// Format v in `size` bytes at `text`, to `digits` significant digits.
+static void show_value(char *text, size_t size, Value v, int digits) {
+    snprintf(text, size, "%.*g", digits, v);
 }
 
+#endif
 
-// UI display
+static const char out_of_range[] = "Number out of range";
 
-enum { colwidth = 18 };
 
-typedef struct Colors Colors;
-struct Colors {
-    unsigned fg, bg;
-};
-static void set_color(Colors colors) {
-    set_background(colors.bg);
-    set_foreground(colors.fg);
-}
+// Compiling cell formulas (called 'expressions' here)
 
-typedef struct Style Style;
-struct Style {
-    Colors unhighlighted, highlighted;
+// A formula compiles to a postfix program for a little stack machine.
+// Most instructions are named by the operator character they came from;
+// these are the others:
+enum {
+    op_push   = '0',  // Push the instruction's operand.
+    op_row    = 'r',  // Push the current row, plus the operand.
+    op_col    = 'c',  // Push the current column, plus the operand.
+    op_negate = '~',  // Negate the top of the stack.
+    op_ref    = 'a',  // Push the value of the cell at the instruction's
+                      //   address: an '@' worked out in compiling.
+    op_jump   = 'j',  // Go to the instruction numbered by the operand;
+    op_branch = '?',  //   or do if the popped top of the stack is 0.
+    op_sum = 256,     // These aggregate over a range, popping its corners:
+    op_min,           //   top@left from under bottom@right.
+    op_max,
+    op_count,
+    op_lookup,        // Pop a key from under a range's corners too: see
+                      //   lookup().
+    op_call,          // Pop a row, column, and `row` arguments, to call
+                      //   the sheet numbered by the operand: see
+                      //   call_sheet().
+    op_foreign,       // Pop a row and column of the workbook's sheet
+                      //   numbered by the operand: see refer_foreign().
+    op_le,            // The comparisons besides '<', '>' and '=':
+    op_ge,            //   <=, >= and <>. They come to 1 if true, else 0.
+    op_ne,
 };
-static Style ok_style = {
-    .unhighlighted = { .fg = black,         .bg = white },
-    .highlighted   = { .fg = bright(white), .bg = bright(blue) }
+
+// The functions over ranges, by name. (lookup takes a key first, and
+// call is different altogether.)
+static const struct { const char *name; int op; } functions[] = {
+    {"sum", op_sum}, {"min", op_min}, {"max", op_max}, {"count", op_count},
+    {"lookup", op_lookup}, {"call", op_call},
 };
-static Style oops_style = {
-    .unhighlighted = { .fg = black,         .bg = bright(cyan) },
-    .highlighted   = { .fg = bright(white), .bg = bright(red) }
+
+typedef struct Instruction Instruction;
+struct Instruction {
+    int op;
+    int row, col;        // For op_ref: the cell's address, absolute or,
+    unsigned char row_relative, col_relative;  // if these say so,
+                         //  relative to the cell evaluating it.
+    Value operand;       // For op_push, op_row, op_col, op_jump and
+};                       //  op_branch.
+
+typedef struct Code Code;
+struct Code {
+    const char *plaint;  // A syntax error to report after running; or NULL.
+    unsigned depth;      // How much stack the program needs.
+    int batchable;       // Whether it's free of aggregates, calls and
+                         //  branches (see evaluate_run()).
+    char *formula;       // The text it's compiled from (malloced),
+    unsigned nusers;     //  shared by this many cells;
+    Code *next;          //  the next code in its bucket of the_codes.
+    unsigned n;          // How many instructions.
+    Instruction program[];
 };
-static Colors border_colors = { .fg = blue, .bg = bright(yellow) };
 
-typedef enum { formulas, values } View;
+enum { max_depth = 256 };  // (Formulas needing more stack can't compile.)
 
-// For the cell at (r,c), show its content or formula according to
-// `view`, in style according to `highlighted`.
-static void show_at(unsigned r, unsigned c, View view, int highlighted) {
-    char text[1024];
-    const Style *style = &ok_style;
-    const char *formula = find_formula(cells[r][c].text);
-    if (view == formulas || !formula)
-        stuff(text, sizeof text, orelse(formula, cells[r][c].text));
-    else {
-        Value value;
-        const char *plaint = get_value(&value, r, c);
-        if (plaint) {
-            style = &oops_style;
-            stuff(text, sizeof text, plaint);
-        }
-        else
-            snprintf(text, sizeof text, "%*g", colwidth, value);
+// A sheet may extend this far:
+enum { max_rows = 1 << 30, max_cols = 1 << 20 };
+
+typedef struct Compiler Compiler;
+struct Compiler {
+    int token;           // The kind of lexical token we just scanned.
+    Value token_value;   //   Its value, if any,
+    int function;        //   or the op of its function, for an 'f' token,
+    const char *string;  //   or for a '"' token, the string's bytes
+    size_t string_length;//   (not null-terminated) and their number.
+    const char *s;       // The rest of the expression to scan.
+    const char *plaint;  // The first error message; NULL if none yet.
+    Instruction *program;       // malloced
+    unsigned n, capacity;
+    unsigned depth, max_depth;  // Stack depth at this point, and its peak.
+    unsigned label;      // The last place jumped to, which can't be folded.
+};
+
+static void fail(Compiler *k, const char *plaint) {
+    if (k->plaint == NULL) {
+        // On the first failure, skip right to the end of the expression,
+        // making finishing the parsing effectively a no-op.
+        k->plaint = plaint;
+        k->s += strlen(k->s);
     }
-    if (colwidth < strlen(text))
-        strcpy(text + colwidth - 3, "...");
-    set_color(highlighted ? style->highlighted : style->unhighlighted);
-    printf(" %*s", colwidth, text);
 }
 
-static void show(View view, unsigned cursor_row, unsigned cursor_col) {
-    printf(HOME);
-    set_color(ok_style.unhighlighted);
-    printf("%-79.79s", cells[cursor_row][cursor_col].text);
-    printf(NEWLINE);
-    set_color(border_colors);
-    printf("%s%*u",
-           view == formulas ? "(formulas)" : "          ",
-           (int) (colwidth - sizeof "(formulas)" + 4), 0);
-    for (unsigned c = 1; c < ncols; ++c)
-        printf(" %*u", colwidth, c);
-    printf(NEWLINE);
-    for (unsigned r = 0; r < nrows; ++r) {
-        set_color(border_colors);
-        printf("%2u", r);
-        for (unsigned c = 0; c < ncols; ++c)
-            show_at(r, c, view, r == cursor_row && c == cursor_col);
-        printf(NEWLINE);
+// Append an instruction which nets `effect` more values on the stack.
+// After a failure the program is cut short; running it then reports
+// the plaint after whatever got compiled before the failure, just as
+// if we'd been evaluating as we parsed.
+static void emit(Compiler *k, int op, Value operand, int effect) {
+    if (k->plaint) return;
+    k->program = grow(k->program, &k->capacity, k->n + 1, sizeof k->program[0]);
+    k->program[k->n++] = (Instruction) {.op = op, .operand = operand};
+    k->depth += effect;
+    if (k->max_depth < k->depth) k->max_depth = k->depth;
+    if (max_depth < k->depth) fail(k, "Formula too complex");
+}
+
+// The arithmetic operations, short of the checks on dividing. An
+// outcome out of range is `overflowed`.
+static Value arithmetic(int rator, Value lhs, Value rhs) {
+    switch (rator) {
+#ifdef DECIMAL
+        case '+': return narrow((Wide) lhs + rhs);
+        case '-': return narrow((Wide) lhs - rhs);
+        case '*': return multiply(lhs, rhs);
+        case '/': return divide(lhs, rhs);
+        case '%': return lhs % rhs;
+        case '^': return power(lhs, rhs);
+#else
+        case '+': return lhs + rhs;
+        case '-': return lhs - rhs;
+        case '*': return lhs * rhs;
+        case '/': return lhs / rhs;
+        case '%': return fmod(lhs, rhs);
+        case '^': return pow(lhs, rhs); // XXX report domain errors
+#endif
+        case '<': return from_integer(lhs < rhs);
+        case '>': return from_integer(lhs > rhs);
+        case '=': return from_integer(lhs == rhs);
+        case op_le: return from_integer(lhs <= rhs);
+        case op_ge: return from_integer(lhs >= rhs);
+        case op_ne: return from_integer(lhs != rhs);
+        default: assert(0); return 0;
     }
-    const char *focus_plaint = cells[cursor_row][cursor_col].plaint;
-    if (focus_plaint == stale) focus_plaint = NULL; // `stale` here means not a formula cell
-    printf("%-80.80s", orelse(the_plaint, orelse(focus_plaint, "")));
-    printf(CLEAR_TO_BOTTOM);
 }
 
+// Is the instruction an integer constant, or else r or c plus one?
+// (Integers well within range, so that any sums of them are exact.)
+static int is_whole(const Instruction *in, int op) {
+    return in->op == op && is_integer(in->operand)
+        && -from_integer(max_rows) < in->operand
+        && in->operand < from_integer(max_rows);
+}
 
-// Main interaction loop and main program
+// Emit the operator `op`, unless it can be worked out now from the
+// instructions just before, its operands: the operation on constants;
+// an offset added to r or c; or an '@' of such an r and c, or of
+// constants, which then needn't be checked in evaluating.
+static void emit_operator(Compiler *k, int op) {
+    Instruction *x = k->label + 2 <= k->n ? &k->program[k->n-2] : NULL;
+    Instruction *y = k->label + 1 <= k->n ? &k->program[k->n-1] : NULL;
+    if (k->plaint) return;
+    if (op == op_negate) {
+        if (y && y->op == op_push)
+            y->operand = -y->operand;
+        else
+            emit(k, op, 0, 0);
+        return;
+    }
+    Value a = x ? x->operand : 0, b = y ? y->operand : 0, v = 0;
+    int constants = x && x->op == op_push && y->op == op_push;
+    if (constants && op != '@' && (b != 0 || (op != '/' && op != '%'))
+        && (v = arithmetic(op, a, b)) != overflowed)  // (Else it's for later.)
+        x->operand = v;
+    else if (x && (op == '+' || op == '-')
+             && (is_whole(x, op_row) || is_whole(x, op_col))
+             && is_whole(y, op_push))
+        x->operand = op == '+' ? a + b : a - b;
+    else if (x && op == '+' && is_whole(x, op_push)
+             && (is_whole(y, op_row) || is_whole(y, op_col)))
+        *x = (Instruction) {.op = y->op, .operand = a + b};
+    else if (x && op == '@'
+             && (is_whole(x, op_row)
+                 || (is_whole(x, op_push)
+                     && 0 <= a && a < from_integer(max_rows)))
+             && (is_whole(y, op_col)
+                 || (is_whole(y, op_push)
+                     && 0 <= b && b < from_integer(max_cols))))
+        *x = (Instruction) {
+            .op = op_ref, .row = to_integer(a), .col = to_integer(b),
+            .row_relative = x->op == op_row, .col_relative = y->op == op_col
+        };
+    else {
+        emit(k, op, 0, -1);
+        return;
+    }
+    --k->n;
+    --k->depth;
+}
+
+// Scan the next lexical token, and advance past it.
+static void lex(Compiler *k) {
+    k->s = skip_blanks(k->s);
+    if (*k->s == '\0')
+        k->token = 0;   // (token 0 means end of input)
+    else if (isdigit(*k->s)) {
+        char *endptr;
+        k->token = '0'; // (meaning a number)
+        k->token_value = scan_value(k->s, &endptr);
+        k->s = endptr; // grumble: you can't just pass &k->s above
+        if (k->token_value == overflowed) fail(k, out_of_range);
+    }
+    else if (isalpha(*k->s)) {
+        const char *word = k->s;
+        size_t n = 0;
+        while (isalpha(word[n])) ++n;
+        k->s += n;
+        if (n == 1 && strchr("cr", *word)) {
+            k->token = *word;
+            return;
+        }
+        if (n == 2 && tolower(word[0]) == 'i' && tolower(word[1]) == 'f') {
+            k->token = 'i'; // (meaning "if")
+            return;
+        }
+        for (size_t i = 0; i < sizeof functions / sizeof functions[0]; ++i) {
+            size_t j = 0;
+            while (j < n && tolower(word[j]) == functions[i].name[j]) ++j;
+            if (j == n && functions[i].name[n] == '\0') {
+                k->token = 'f'; // (meaning a function name)
+                k->function = functions[i].op;
+                return;
+            }
+        }
+        fail(k, "Syntax error: unknown token type");
+        k->token = 0;
+    }
+    else if (*k->s == '"') {
+        const char *end = strchr(k->s + 1, '"');
+        if (!end) {
+            fail(k, "Syntax error: unterminated string");
+            k->token = 0;
+            return;
+        }
+        k->token = '"'; // (meaning a string)
+        k->string = k->s + 1;
+        k->string_length = end - (k->s + 1);
+        k->s = end + 1;
+    }
+    else if (k->s[0] == '<' && (k->s[1] == '=' || k->s[1] == '>')) {
+        k->token = k->s[1] == '=' ? op_le : op_ne;
+        k->s += 2;
+    }
+    else if (k->s[0] == '>' && k->s[1] == '=') {
+        k->token = op_ge;
+        k->s += 2;
+    }
+    else if (strchr("+-*/%^@:(),<>=!", *k->s))
+        k->token = *k->s++;
+    else {
+        fail(k, "Syntax error: unknown token type");
+        k->token = 0;
+    }
+}
+
+// These parser functions emit the code for what they parse.
+static void parse_expr(Compiler *k, int precedence);
+
+static void expect(Compiler *k, int token, const char *plaint) {
+    if (k->token != token)
+        fail(k, plaint);
+    lex(k);
+}
+
+// Parse a range, r1@c1:r2@c2, emitting code to push its four coordinates.
+// (The coordinates bind as tightly as the operands of an '@' do.)
+static void parse_range(Compiler *k) {
+    parse_expr(k, 8);
+    expect(k, '@', "Syntax error: expected '@'");
+    parse_expr(k, 8);
+    expect(k, ':', "Syntax error: expected ':'");
+    parse_expr(k, 8);
+    expect(k, '@', "Syntax error: expected '@'");
+    parse_expr(k, 8);
+}
+
+static unsigned callee_number(const char *filename, size_t length);
+static unsigned sheet_number(const char *filename, size_t length);
+
+// Parse the rest of call("sheet", row, col, arguments...), after the
+// "call(".
+static void parse_call(Compiler *k) {
+    if (k->token != '"') {
+        fail(k, "Syntax error: expected a sheet's filename");
+        return;
+    }
+    unsigned sheet = callee_number(k->string, k->string_length);
+    lex(k);
+    unsigned n = 0;
+    for (; k->token == ','; ++n) {
+        lex(k);
+        parse_expr(k, 0);
+    }
+    if (n < 2) fail(k, "Syntax error: expected a row and column to call");
+    expect(k, ')', "Syntax error: expected ')'");
+    emit(k, op_call, sheet, 1 - (int) n);
+    if (!k->plaint) k->program[k->n-1].row = n - 2;
+}
+
+static void parse_factor(Compiler *k) {
+    switch (k->token) {
+        case '0': emit(k, op_push, k->token_value, 1); lex(k); break;
+        case '-': lex(k); parse_factor(k); emit_operator(k, op_negate); break;
+        case 'c': lex(k); emit(k, op_col, 0, 1); break;
+        case 'r': lex(k); emit(k, op_row, 0, 1); break;
+        case '(':
+            lex(k); 
+            parse_expr(k, 0);
+            expect(k, ')', "Syntax error: expected ')'");
+            break;
+        case '"': {
+            // "sheet"!r@c refers to a cell of another sheet.
+            unsigned sheet = sheet_number(k->string, k->string_length);
+            lex(k);
+            expect(k, '!', "Syntax error: expected '!'");
+            parse_expr(k, 8);
+            expect(k, '@', "Syntax error: expected '@'");
+            parse_expr(k, 8);
+            emit(k, op_foreign, sheet, -1);
+            break;
+        }
+        case 'i': {
+            // if(test, then, else) runs only the one of `then` and
+            // `else` that the test picks.
+            lex(k);
+            expect(k, '(', "Syntax error: expected '('");
+            parse_expr(k, 0);
+            expect(k, ',', "Syntax error: expected ','");
+            unsigned branch = k->n;
+            emit(k, op_branch, 0, -1);
+            unsigned depth = k->depth;
+            parse_expr(k, 0);
+            expect(k, ',', "Syntax error: expected ','");
+            unsigned jump = k->n;
+            emit(k, op_jump, 0, 0);
+            k->depth = depth;
+            if (branch < k->n) k->program[branch].operand = k->label = k->n;
+            parse_expr(k, 0);
+            expect(k, ')', "Syntax error: expected ')'");
+            // (After a failure these go to the end of the program.)
+            if (jump < k->n) k->program[jump].operand = k->label = k->n;
+            break;
+        }
+        case 'f': {
+            int op = k->function;
+            lex(k);
+            expect(k, '(', "Syntax error: expected '('");
+            if (op == op_call) {
+                parse_call(k);
+                break;
+            }
+            if (op == op_lookup) {
+                parse_expr(k, 0);
+                expect(k, ',', "Syntax error: expected ','");
+            }
+            parse_range(k);
+            expect(k, ')', "Syntax error: expected ')'");
+            emit(k, op, 0, op == op_lookup ? -4 : -3);
+            break;
+        }
+        default:
+            fail(k, "Syntax error: expected a factor");
+            lex(k);
+    }
+}
+
+// Parse an infix subexpression, in the right-context of an operator
+// binding of tightness `precedence` (lower numbers meaning less tightly).
+// (This method is called precedence-climbing.)
+static void parse_expr(Compiler *k, int precedence) {
+    parse_factor(k); // left-hand side of a potentially infix expr
+    for (;;) {
+        int lp, rp, rator = k->token;  // left/right precedence and operator
+        switch (rator) {
+            case '+': lp = 1; rp = 2; break;
+            case '-': lp = 1; rp = 2; break;
+            case '*': lp = 3; rp = 4; break;
+            case '/': lp = 3; rp = 4; break;
+            case '%': lp = 3; rp = 4; break;
+            case '^': lp = 5; rp = 5; break;
+            case '<': case '>': case '=':
+            case op_le: case op_ge: case op_ne: lp = 0; rp = 1; break;
+            case '@': lp = 7; rp = 8; break;
+            default: return;
+        }
+        if (lp < precedence) return;
+        lex(k);
+        parse_expr(k, rp);
+        emit_operator(k, rator);
+    }
+}
+
+static int is_batchable(const Code *code) {
+    for (unsigned i = 0; i < code->n; ++i)
+        if ((op_sum <= code->program[i].op && code->program[i].op <= op_foreign)
+            || code->program[i].op == op_branch)
+            return 0;
+    return 1;
+}
+
+// Compile a complete formula. The result is malloced.
+static Code *compile(const char *formula) {
+    Compiler compiler = {.s = formula, .plaint = NULL};
+    Compiler *k = &compiler;
+    lex(k);
+    parse_expr(k, 0);
+    if (k->token != 0) fail(k, "Syntax error: unexpected token");
+    Code *code = malloc(sizeof *code + k->n * sizeof code->program[0]);
+    if (!code) panic("Out of memory");
+    code->plaint = k->plaint;
+    code->depth = k->max_depth;
+    code->formula = NULL;
+    code->nusers = 0;
+    code->next = NULL;
+    code->n = k->n;
+    if (k->n) memcpy(code->program, k->program, k->n * sizeof k->program[0]);
+    code->batchable = is_batchable(code);
+    free(k->program);
+    return code;
+}
+
+// Cells with the same formula share its code, since what it does
+// differs only by the r and c it runs with. (Copying formulas around
+// makes many such cells.) The shared codes go in a hash table by
+// formula, chained.
+static Code **the_codes;
+static unsigned codes_size;   // Its number of buckets: 0 or a power of 2.
+static unsigned ncodes;       // How many codes are in it.
+
+static unsigned hash_bytes(const char *s, size_t n) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ (unsigned char) s[i]) * 16777619u;
+    return h;
+}
+
+static unsigned formula_hash(const char *formula) {
+    return hash_bytes(formula, strlen(formula));
+}
+
+// Add a new code to the_codes.
+static void add_code(Code *code) {
+    if (codes_size <= 2 * ncodes) {
+        unsigned size = codes_size ? 2 * codes_size : 64;
+        Code **codes = calloc(size, sizeof codes[0]);
+        if (!codes) panic("Out of memory");
+        for (unsigned i = 0; i < codes_size; ++i)
+            while (the_codes[i]) {
+                Code *code = the_codes[i];
+                the_codes[i] = code->next;
+                unsigned j = formula_hash(code->formula) & (size-1);
+                code->next = codes[j];
+                codes[j] = code;
+            }
+        free(the_codes);
+        the_codes = codes;
+        codes_size = size;
+    }
+    Code **bucket = &the_codes[formula_hash(code->formula) & (codes_size-1)];
+    code->next = *bucket;
+    *bucket = code;
+    ++ncodes;
+}
+
+// Return the code for `formula`, compiling it if it's new, and count
+// one more user of it.
+static Code *share_code(const char *formula) {
+    unsigned h = formula_hash(formula);
+    for (Code *code = codes_size ? the_codes[h & (codes_size-1)] : NULL;
+         code; code = code->next)
+        if (0 == strcmp(code->formula, formula)) {
+            ++code->nusers;
+            return code;
+        }
+    Code *code = compile(formula);
+    code->formula = dupe(formula);
+    code->nusers = 1;
+    add_code(code);
+    return code;
+}
+
+// Count one less user of `code` (if any), freeing it on the last.
+static void release_code(Code *code) {
+    if (!code || 0 < --code->nusers) return;
+    Code **link = &the_codes[formula_hash(code->formula) & (codes_size-1)];
+    while (*link != code) link = &(*link)->next;
+    *link = code->next;
+    --ncodes;
+    free(code->formula);
+    free(code);
+}
+
+
+// Cell addresses, and growable lists of them
+
+typedef struct Address Address;
+struct Address {
+    unsigned row, col;
+};
+
+typedef struct Addresses Addresses;
+struct Addresses {
+    Address *at;         // malloced
+    unsigned n, capacity;
+};
+
+static void push_address(Addresses *a, unsigned row, unsigned col) {
+    a->at = grow(a->at, &a->capacity, a->n + 1, sizeof a->at[0]);
+    a->at[a->n++] = (Address) {.row = row, .col = col};
+}
+
+// Remove one occurrence of (row,col), if there is one. (Order isn't kept.)
+static void remove_address(Addresses *a, unsigned row, unsigned col) {
+    for (unsigned i = 0; i < a->n; ++i)
+        if (a->at[i].row == row && a->at[i].col == col) {
+            a->at[i] = a->at[--a->n];
+            return;
+        }
+}
+
+static int same_addresses(const Addresses *a, const Addresses *b) {
+    return a->n == b->n
+        && (a->n == 0 || 0 == memcmp(a->at, b->at, a->n * sizeof a->at[0]));
+}
+
+// A rectangle of cells, inclusive of its edges.
+typedef struct Range Range;
+struct Range {
+    unsigned top, bottom, left, right;
+};
+
+typedef struct Ranges Ranges;
+struct Ranges {
+    Range *at;           // malloced
+    unsigned n, capacity;
+};
+
+static int in_range(Range range, unsigned row, unsigned col) {
+    return range.top <= row && row <= range.bottom
+        && range.left <= col && col <= range.right;
+}
+
+static void push_range(Ranges *a, Range range) {
+    a->at = grow(a->at, &a->capacity, a->n + 1, sizeof a->at[0]);
+    a->at[a->n++] = range;
+}
+
+static int same_ranges(const Ranges *a, const Ranges *b) {
+    return a->n == b->n
+        && (a->n == 0 || 0 == memcmp(a->at, b->at, a->n * sizeof a->at[0]));
+}
+
+// A cell of some sheet of the workbook (see "Workbooks" below).
+typedef struct Sheet Sheet;
+typedef struct Link Link;
+struct Link {
+    Sheet *sheet;
+    unsigned row, col;
+};
+
+typedef struct Links Links;
+struct Links {
+    Link *at;            // malloced
+    unsigned n, capacity;
+};
+
+// A cell's references to and from cells of other sheets, like its
+// refs and users within its own.
+typedef struct Elsewhere Elsewhere;
+struct Elsewhere {
+    Links refs, users;
+};
+
+
+// Running compiled formulas
+
+typedef struct Evaluator Evaluator;
+struct Evaluator {
+    unsigned row, col;   // Which cell we're evaluating.
+    const char *plaint;  // The first error message; NULL if none yet.
+    Addresses refs;      // The cells referred to so far,
+    Ranges ranges;       //  and the ranges aggregated over,
+    Links links;         //  and the cells of other sheets.
+    unsigned pc, sp;     // Where a suspended evaluation got to,
+    Address awaited;     //  waiting on this cell's value
+    Sheet *awaited_sheet;//  (in this other sheet, if not NULL),
+    int awaits_index;    //  or on its column's index, if true.
+    unsigned low;        // If it met a cycle, how far down it reaches
+                         //  (see settle()); else 0.
+};
+
+// An evaluation that needs the value of a cell not yet computed gets
+// suspended, to be resumed once the cell is up to date.
+static const char pending[] = "Pending"; // N.B. never seen in the UI.
+
+static void complain(Evaluator *e, const char *plaint) {
+    if (e->plaint == NULL)
+        e->plaint = plaint;
+}
+
+static Value zero_divide(Evaluator *e) {
+    complain(e, "Divide by 0");
+    return 0;
+}
+
+static Value refer(Evaluator *e, Value r, Value c);
+static Value refer_address(Evaluator *e, const Instruction *in);
+static Value aggregate(Evaluator *e, int op, const Value *corners);
+static Value lookup(Evaluator *e, Value key, const Value *corners);
+static Value call_sheet(Evaluator *e, const Instruction *in,
+                        const Value *args);
+static Value refer_foreign(Evaluator *e, unsigned sheet, Value r, Value c);
+
+static Value apply(Evaluator *e, int rator, Value lhs, Value rhs) {
+    switch (rator) {
+        case '/': case '%': if (rhs == 0) return zero_divide(e); break;
+        case '@': return refer(e, lhs, rhs);
+    }
+    Value v = arithmetic(rator, lhs, rhs);
+    if (v != overflowed) return v;
+    complain(e, out_of_range);
+    return 0;
+}
+
+// Evaluate a compiled formula, or resume evaluating it, using `stack`
+// of at least code->depth+1 values. We stop at the first error, since
+// its plaint is the one that gets reported. If we have to wait on
+// another cell, return `pending` with the state saved in e.
+static const char *evaluate(Value *result, Evaluator *e, const Code *code,
+                            Value *stack) {
+    Value *sp = stack + e->sp;  // Points just past the top of the stack.
+    const Instruction *pc = code->program + e->pc, *end = code->program + code->n;
+    for (; pc < end && !e->plaint; ++pc)
+        switch (pc->op) {
+            case op_push:   *sp++ = pc->operand; break;
+            case op_row:    *sp++ = from_integer(e->row) + pc->operand; break;
+            case op_col:    *sp++ = from_integer(e->col) + pc->operand; break;
+            case op_ref: {
+                Value v = refer_address(e, pc);
+                if (e->plaint == pending) goto suspend;
+                *sp++ = v;
+                break;
+            }
+            case op_branch:
+                if (*--sp != 0) break;
+                // Else fall through.
+            case op_jump:
+                pc = code->program + (unsigned) pc->operand - 1;
+                break;
+            case op_negate: sp[-1] = -sp[-1]; break;
+            case op_sum: case op_min: case op_max: case op_count: {
+                Value v = aggregate(e, pc->op, sp - 4);
+                if (e->plaint == pending) goto suspend;
+                sp -= 3;
+                sp[-1] = v;
+                break;
+            }
+            case op_lookup: {
+                Value v = lookup(e, sp[-5], sp - 4);
+                if (e->plaint == pending) goto suspend;
+                sp -= 4;
+                sp[-1] = v;
+                break;
+            }
+            case op_call: {
+                unsigned n = pc->row + 2;
+                Value v = call_sheet(e, pc, sp - n);
+                if (e->plaint == pending) goto suspend;
+                sp -= n - 1;
+                sp[-1] = v;
+                break;
+            }
+            case op_foreign: {
+                Value v = refer_foreign(e, pc->operand, sp[-2], sp[-1]);
+                if (e->plaint == pending) goto suspend;
+                --sp;
+                sp[-1] = v;
+                break;
+            }
+            default: {
+                Value v = apply(e, pc->op, sp[-2], sp[-1]);
+                if (e->plaint == pending) goto suspend;
+                *(--sp - 1) = v;
+            }
+        }
+    if (code->plaint) complain(e, code->plaint);
+    if (!e->plaint) *result = sp[-1];
+    return e->plaint;
+
+ suspend:
+    e->plaint = NULL;
+    e->pc = pc - code->program;
+    e->sp = sp - stack;
+    return pending;
+}
+
+
+// Storing the texts of cells
+
+// Each distinct text is kept once, however many cells have it, in a
+// hash table like the_codes. The texts themselves get packed into big
+// chunks of memory, pools: one for what we load from files, which
+// just grows until the sheet's cleared, and one for edits, which gets
+// compacted once it's mostly texts no longer used.
+typedef struct Text Text;
+struct Text {
+    Text *next;          // The next text in its bucket of the_texts.
+    unsigned nusers;     // How many blocks of texts (and the like) have it.
+    unsigned length;
+    int edited;          // Whether it's in edited_pool.
+    char chars[];
+};
+
+typedef struct Pool Pool;
+struct Pool {
+    char **chunks;       // malloced, and each chunk malloced
+    unsigned nchunks, chunks_capacity;
+    char *next;          // Where the last chunk's free space starts,
+    size_t free;         //  and how much there is.
+    size_t total;        // How much of the chunks texts took up,
+    size_t garbage;      //  and how much of that they don't need any more.
+};
+
+enum { chunk_size = 64 * 1024 };
+
+static Pool loaded_pool, edited_pool;
+static int loading;           // Whether new texts are from a file.
+
+static Text **the_texts;
+static unsigned texts_size;   // Its number of buckets: 0 or a power of 2.
+static unsigned ntexts;       // How many texts are in it.
+
+// This counts up whenever texts may move or get freed, so that the
+// address of a text, as of some count, can't come to be another's.
+static unsigned texts_epoch = 1;
+
+static size_t text_size(size_t length) {
+    size_t size = sizeof(Text) + length + 1;
+    return (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+}
+
+static void *pool_alloc(Pool *pool, size_t size) {
+    if (pool->free < size) {
+        size_t n = size < chunk_size ? chunk_size : size;
+        pool->chunks = grow(pool->chunks, &pool->chunks_capacity,
+                            pool->nchunks + 1, sizeof pool->chunks[0]);
+        pool->chunks[pool->nchunks] = malloc(n);
+        if (!pool->chunks[pool->nchunks]) panic("Out of memory");
+        pool->next = pool->chunks[pool->nchunks++];
+        pool->free = n;
+    }
+    void *p = pool->next;
+    pool->next += size;
+    pool->free -= size;
+    pool->total += size;
+    return p;
+}
+
+static void free_pool(Pool *pool) {
+    for (unsigned i = 0; i < pool->nchunks; ++i)
+        free(pool->chunks[i]);
+    free(pool->chunks);
+    *pool = (Pool) {0};
+}
+
+static void compact_texts(void);
+
+// Return the stored copy of the `length` bytes at `text` (which needn't
+// be null-terminated), counting one more user of it.
+static Text *share_text(const char *text, size_t length) {
+    unsigned h = hash_bytes(text, length);
+    for (Text *t = texts_size ? the_texts[h & (texts_size-1)] : NULL;
+         t; t = t->next)
+        if (t->length == length && 0 == memcmp(t->chars, text, length)) {
+            ++t->nusers;
+            return t;
+        }
+    if (texts_size <= 2 * ntexts) {
+        unsigned size = texts_size ? 2 * texts_size : 1024;
+        Text **texts = calloc(size, sizeof texts[0]);
+        if (!texts) panic("Out of memory");
+        for (unsigned i = 0; i < texts_size; ++i)
+            while (the_texts[i]) {
+                Text *t = the_texts[i];
+                the_texts[i] = t->next;
+                unsigned j = hash_bytes(t->chars, t->length) & (size-1);
+                t->next = texts[j];
+                texts[j] = t;
+            }
+        free(the_texts);
+        the_texts = texts;
+        texts_size = size;
+    }
+    Pool *pool = loading ? &loaded_pool : &edited_pool;
+    Text *t = pool_alloc(pool, text_size(length));
+    t->nusers = 1;
+    t->length = length;
+    t->edited = !loading;
+    memcpy(t->chars, text, length);
+    t->chars[length] = '\0';
+    Text **bucket = &the_texts[h & (texts_size-1)];
+    t->next = *bucket;
+    *bucket = t;
+    ++ntexts;
+    return t;
+}
+
+// Count one less user of `t`, dropping it on the last; but unlike
+// release_text(), never compacting, so the other texts stay put.
+static void uncount_text(Text *t) {
+    if (0 < --t->nusers) return;
+    Text **link = &the_texts[hash_bytes(t->chars, t->length) & (texts_size-1)];
+    while (*link != t) link = &(*link)->next;
+    *link = t->next;
+    --ntexts;
+    Pool *pool = t->edited ? &edited_pool : &loaded_pool;
+    pool->garbage += text_size(t->length);
+}
+
+// Count one less user of `t` (if any), dropping it on the last. N.B.
+// that can move the edited texts, `t` too if it lives on.
+static void release_text(Text *t) {
+    if (!t) return;
+    uncount_text(t);
+    if (t->edited && chunk_size < edited_pool.total
+        && edited_pool.total < 2 * edited_pool.garbage)
+        compact_texts();
+}
+
+static void clear_texts(void) {
+    ++texts_epoch;
+    free_pool(&loaded_pool);
+    free_pool(&edited_pool);
+    free(the_texts);
+    the_texts = NULL;
+    texts_size = ntexts = 0;
+}
+
+
+// The sheet of spreadsheet cells
+
+static const char *the_plaint = NULL;
+static pthread_mutex_t the_plaint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void oops(const char *plaint) {
+    pthread_mutex_lock(&the_plaint_lock);
+    if (!the_plaint)
+        the_plaint = plaint;
+    pthread_mutex_unlock(&the_plaint_lock);
+}
+
+typedef struct Cell Cell;
+struct Cell {
+    Code *code;          // text's compiled formula (shared), or NULL if none
+    Addresses refs;      // The cells this one's value was computed from,
+    Ranges ranges;       //  and the ranges it aggregated over;
+    Addresses users;     //  and the cells computed from this one's value.
+    Elsewhere *elsewhere;// malloced, or NULL if without links elsewhere.
+    int listed;          // Whether it's on the stale_list.
+    int dirty;           // Whether it's on the dirty_list.
+    unsigned low;        // While it's being recalculated, or it's in a
+                         //  cycle not all found yet, 1 + the lowest
+                         //  frame it reaches (see settle()); else 0.
+    unsigned evals;      // How many times it's been evaluated,
+    double self_time;    //  taking how many seconds itself,
+    double total_time;   //  and with the stale cells it awaited.
+};
+
+// These other states for a cell's plaint have special meaning:
+static const char stale[] = "Stale"; // N.B. never seen in the UI.
+static const char cycle[] = "Cycle";
+static const char no_formula[] = "No value for referred cell";
+
+// A cell's state is a byte: its plaint's index in this table (where
+// we add the others as they turn up). The plaints are all in static
+// memory, so there can't be many.
+enum { valid_state, stale_state, cycle_state, no_formula_state };
+static const char *plaints[256] = {NULL, stale, cycle, no_formula};
+static unsigned nplaints = 4;
+
+static unsigned char state_of(const char *plaint) {
+    for (unsigned i = 0; i < nplaints; ++i)
+        if (plaints[i] == plaint) return i;
+    if (nplaints == 256) panic("Too many kinds of plaint");
+    plaints[nplaints] = plaint;
+    return nplaints++;
+}
+
+// Like state_of(), for the text of a plaint (of n bytes) rather than
+// its address: for plaints from files. A new one gets a copy that we
+// keep for good, as if it were static.
+static unsigned char state_named(const char *text, size_t n) {
+    for (unsigned i = 1; i < nplaints; ++i)
+        if (strlen(plaints[i]) == n && 0 == memcmp(plaints[i], text, n))
+            return i;
+    return state_of(dupe_bytes(text, n));
+}
+
+// Cells live in fixed-size tiles, allocated only once some cell in
+// them gets used, and found by a hash table on the tile coordinates.
+// Within a tile the cells go column by column, so that scanning down
+// a column walks through consecutive memory.
+enum { tile_rows = 64, tile_cols = 4 };
+
+// The states and values of the cells, wanted most in recalculating,
+// go apart from the rest, packed together; and so do their texts. Each
+// goes in a block of its own, which versions of the sheet may share
+// (see "Versions of the sheet").
+typedef struct Shared Shared;
+struct Shared {          // The first member of what versions share:
+    unsigned nusers;     //  how many links to it there are, from tries.
+};
+
+typedef struct Texts Texts;
+struct Texts {
+    Shared shared;
+    Texts *prev, *next;  // In the list of all the sheet's Texts.
+    Text *at[tile_cols][tile_rows];  // Each counting this a user; or NULL.
+};
+
+typedef struct Computed Computed;
+struct Computed {
+    Shared shared;
+    Value values[tile_cols][tile_rows];          // Valid with valid_state.
+    unsigned char states[tile_cols][tile_rows];
+};
+
+typedef struct Tile Tile;
+struct Tile {
+    unsigned row, col;   // The address of the tile's top-left cell.
+    Computed *computed;  // Its blocks in the sheet as it is, which are
+    Texts *texts;        //  the sheet's own, not shared, as of these
+    unsigned computed_own, texts_own;  // counts of versions taken.
+    Cell cells[tile_cols][tile_rows];
+};
+
+static Tile **tiles;          // The hash table, of malloced tiles.
+static unsigned tiles_size;   // Its number of slots: 0 or a power of 2.
+static unsigned ntiles;       // Its number of slots filled.
+static Tile *last_tile;       // The tile we found last; likely wanted next.
+
+// While this is set, other threads are reading the sheet, and it must
+// not change -- even last_tile.
+static int speculating;
+
+static unsigned tile_hash(unsigned row, unsigned col) {
+    unsigned h = (row / tile_rows) * 0x9E3779B1u ^ (col / tile_cols) * 0x85EBCA77u;
+    return h ^ (h >> 15);
+}
+
+static void insert_tile(Tile *tile) {
+    unsigned i = tile_hash(tile->row, tile->col);
+    while (tiles[i & (tiles_size-1)]) ++i;
+    tiles[i & (tiles_size-1)] = tile;
+}
+
+// Return the tile holding (row,col), or NULL if none is allocated.
+static Tile *find_tile(unsigned row, unsigned col) {
+    row -= row % tile_rows;
+    col -= col % tile_cols;
+    if (last_tile && last_tile->row == row && last_tile->col == col)
+        return last_tile;
+    if (tiles_size == 0) return NULL;
+    for (unsigned i = tile_hash(row, col); ; ++i) {
+        Tile *tile = tiles[i & (tiles_size-1)];
+        if (!tile) return NULL;
+        if (tile->row == row && tile->col == col) {
+            if (!speculating) last_tile = tile;
+            return tile;
+        }
+    }
+}
+
+static void add_blocks(Tile *tile);
+
+static Tile *add_tile(unsigned row, unsigned col) {
+    if (tiles_size <= 2 * ntiles) {
+        Tile **old = tiles;
+        unsigned old_size = tiles_size;
+        tiles_size = old_size ? 2 * old_size : 64;
+        tiles = calloc(tiles_size, sizeof tiles[0]);
+        if (!tiles) panic("Out of memory");
+        for (unsigned i = 0; i < old_size; ++i)
+            if (old[i]) insert_tile(old[i]);
+        free(old);
+    }
+    Tile *tile = calloc(1, sizeof *tile);
+    if (!tile) panic("Out of memory");
+    tile->row = row - row % tile_rows;
+    tile->col = col - col % tile_cols;
+    add_blocks(tile);
+    insert_tile(tile);
+    ++ntiles;
+    return last_tile = tile;
+}
+
+// Return the cell at (row,col), or NULL if it was never used.
+static Cell *find_cell(unsigned row, unsigned col) {
+    Tile *tile = find_tile(row, col);
+    return tile ? &tile->cells[col % tile_cols][row % tile_rows] : NULL;
+}
+
+// Like find_cell(), but making the cell if it doesn't exist yet.
+static Cell *get_cell(unsigned row, unsigned col) {
+    assert(row < max_rows && col < max_cols);
+    Tile *tile = find_tile(row, col);
+    if (!tile) tile = add_tile(row, col);
+    return &tile->cells[col % tile_cols][row % tile_rows];
+}
+
+// Return the state of the cell at (row,col), which is no_formula_state
+// if it was never used.
+static unsigned get_state(unsigned row, unsigned col) {
+    const Tile *tile = find_tile(row, col);
+    return tile ? tile->computed->states[col % tile_cols][row % tile_rows]
+                : no_formula_state;
+}
+
+static Computed *own_computed(Tile *tile);
+static Texts *own_texts(Tile *tile);
+
+// Set the state of the cell at (row,col), which must exist.
+static void set_state(unsigned row, unsigned col, unsigned state) {
+    Tile *tile = find_tile(row, col);
+    own_computed(tile)->states[col % tile_cols][row % tile_rows] = state;
+}
+
+// Return the cell's text, or NULL if it's empty.
+static Text *find_text(unsigned row, unsigned col) {
+    const Tile *tile = find_tile(row, col);
+    return tile ? tile->texts->at[col % tile_cols][row % tile_rows] : NULL;
+}
+
+static const char *get_text(unsigned row, unsigned col) {
+    const Text *t = find_text(row, col);
+    return t ? t->chars : "";
+}
+
+static Texts *all_texts;       // The list of the sheet's Texts blocks.
+
+static int hold_texts(void);
+static void unhold_texts(void);
+
+// Move the live edited texts into fresh chunks, and free the old ones;
+// unless another thread is reading texts, and then leave it for later.
+static void compact_texts(void) {
+    if (!hold_texts()) return;
+    ++texts_epoch;
+    Pool old = edited_pool;
+    edited_pool = (Pool) {0};
+    // Copy each, leaving its new address in the old one's `next`.
+    for (unsigned i = 0; i < texts_size; ++i)
+        for (Text **link = &the_texts[i]; *link; link = &(*link)->next) {
+            Text *t = *link;
+            if (!t->edited) continue;
+            size_t size = text_size(t->length);
+            Text *copy = pool_alloc(&edited_pool, size);
+            memcpy(copy, t, size);
+            t->next = copy;
+            *link = copy;
+        }
+    // (In the blocks of every version, not just the sheet's own.)
+    for (Texts *block = all_texts; block; block = block->next)
+        for (unsigned c = 0; c < tile_cols; ++c)
+            for (unsigned r = 0; r < tile_rows; ++r) {
+                Text **t = &block->at[c][r];
+                if (*t && (*t)->edited) *t = (*t)->next;
+            }
+    free_pool(&old);
+    unhold_texts();
+}
+
+static int compare_tiles(const void *x, const void *y) {
+    const Tile *s = *(Tile *const *)x, *t = *(Tile *const *)y;
+    if (s->row != t->row) return s->row < t->row ? -1 : 1;
+    if (s->col != t->col) return s->col < t->col ? -1 : 1;
+    return 0;
+}
+
+// Return a malloced array of all ntiles tiles, in row-major order.
+static Tile **sort_tiles(void) {
+    Tile **sorted = malloc((ntiles ? ntiles : 1) * sizeof sorted[0]);
+    if (!sorted) panic("Out of memory");
+    unsigned n = 0;
+    for (unsigned i = 0; i < tiles_size; ++i)
+        if (tiles[i]) sorted[n++] = tiles[i];
+    qsort(sorted, n, sizeof sorted[0], compare_tiles);
+    return sorted;
+}
+
+// Versions of the sheet
+
+// The sheet as it is at some moment can be kept, as a version, for a
+// reader to go on with while the sheet changes: undo, the writer saving
+// in the background, the server's reader thread. Each version has two
+// tries, one of the tiles' blocks of texts and one of their computed
+// blocks, keyed by the tile's coordinates; the sheet has its own pair,
+// `live`. They share whatever they have in common, branches and blocks
+// alike, counting how many tries have each. So taking a version only
+// counts another user of the sheet's two roots; and changing a block
+// after that makes copies of it and of the branches down to it, for
+// the sheet's own, and changes those. The version keeps the originals
+// unchanged. (Only the main thread counts, copies, or drops.)
+enum { key_bits = 6, key_levels = 7 };  // Enough for any tile_key().
+
+typedef struct Branch Branch;
+struct Branch {
+    Shared shared;
+    uint64_t present;    // Bit d is set iff there's a kid of digit d,
+    unsigned capacity;   //  and kids holds those kids in order, with
+    Shared *kids[];      //  room for this many.
+};
+
+typedef struct Version Version;
+struct Version {
+    Shared *texts, *computed;  // The roots of its tries, or NULL.
+};
+
+static Version live;
+static unsigned texts_taken = 1, computed_taken = 1;  // Counts of takes.
+
+static int clearing;     // Whether the sheet's texts all go at once.
+
+// (max_cols / tile_cols is 1 << 18.)
+static uint64_t tile_key(unsigned row, unsigned col) {
+    return (uint64_t) (row / tile_rows) << 18 | col / tile_cols;
+}
+
+static unsigned key_digit(uint64_t key, unsigned level) {
+    return key >> key_bits * (key_levels - 1 - level) & ((1 << key_bits) - 1);
+}
+
+static unsigned count_bits(uint64_t x) {
+    x -= x >> 1 & UINT64_C(0x5555555555555555);
+    x = (x & UINT64_C(0x3333333333333333))
+      + (x >> 2 & UINT64_C(0x3333333333333333));
+    x = (x + (x >> 4)) & UINT64_C(0x0F0F0F0F0F0F0F0F);
+    return x * UINT64_C(0x0101010101010101) >> 56;
+}
+
+// Return the block of `key` in the trie at `node`, or NULL if none.
+static const Shared *find_block(const Shared *node, uint64_t key) {
+    for (unsigned level = 0; node && level < key_levels; ++level) {
+        const Branch *b = (const Branch *) node;
+        uint64_t bit = (uint64_t) 1 << key_digit(key, level);
+        node = b->present & bit ? b->kids[count_bits(b->present & (bit-1))]
+                                : NULL;
+    }
+    return node;
+}
+
+// Return the link to the block of `key` in the trie at *link (NULL if
+// there's none yet), making each branch on the way the trie's own:
+// one that's shared gets copied, and the copy's kids counted again.
+static Shared **block_link(Shared **link, uint64_t key) {
+    for (unsigned level = 0; level < key_levels; ++level) {
+        Branch *b = (Branch *) *link;
+        uint64_t bit = (uint64_t) 1 << key_digit(key, level);
+        unsigned n = b ? count_bits(b->present) : 0;
+        unsigned i = b ? count_bits(b->present & (bit-1)) : 0;
+        int adding = !b || !(b->present & bit);
+        if (!b || 1 < b->shared.nusers || (adding && n == b->capacity)) {
+            unsigned capacity = adding ? (n < 32 ? 2*n + 1 : 64) : n;
+            Branch *copy = malloc(sizeof *copy + capacity * sizeof copy->kids[0]);
+            if (!copy) panic("Out of memory");
+            copy->shared.nusers = 1;
+            copy->present = b ? b->present : 0;
+            copy->capacity = capacity;
+            if (b) {
+                memcpy(copy->kids, b->kids, i * sizeof b->kids[0]);
+                memcpy(copy->kids + i + adding, b->kids + i,
+                       (n - i) * sizeof b->kids[0]);
+                if (b->shared.nusers == 1)
+                    free(b);
+                else {
+                    --b->shared.nusers;
+                    for (unsigned j = 0; j < n; ++j)
+                        ++b->kids[j]->nusers;
+                }
+            }
+            *link = &copy->shared;
+            b = copy;
+        }
+        else if (adding)
+            memmove(b->kids + i + 1, b->kids + i, (n - i) * sizeof b->kids[0]);
+        if (adding) {
+            b->present |= bit;
+            b->kids[i] = NULL;
+        }
+        link = &b->kids[i];
+    }
+    return link;
+}
+
+// Return the block of `key`, which must exist, in the trie at *root,
+// making it the trie's own: a `copy` of it if it's shared.
+static Shared *own_block(Shared **root, uint64_t key,
+                         Shared *(*copy)(const Shared *)) {
+    Shared **link = block_link(root, key);
+    if (1 < (*link)->nusers) {
+        --(*link)->nusers;
+        *link = copy(*link);
+    }
+    return *link;
+}
+
+// Count one less user of the trie at `node`, a branch of `level` (or a
+// block, at key_levels), dropping whatever that leaves unused.
+static void drop_trie(Shared *node, unsigned level, void (*drop)(Shared *)) {
+    if (!node || --node->nusers) return;
+    if (level == key_levels) {
+        drop(node);
+        return;
+    }
+    Branch *b = (Branch *) node;
+    for (unsigned i = 0, n = count_bits(b->present); i < n; ++i)
+        drop_trie(b->kids[i], level + 1, drop);
+    free(b);
+}
+
+// A block of a trie, with the address of its tile's top-left cell.
+typedef struct Leaf Leaf;
+struct Leaf {
+    unsigned row, col;
+    const Shared *block;
+};
+
+// Add to *leaves the blocks of the trie at `node`, a branch of `level`
+// reached by the digits `key`, in the order of their keys: row-major
+// by tile.
+static void list_blocks(Leaf **leaves, unsigned *n, unsigned *capacity,
+                        const Shared *node, unsigned level, uint64_t key) {
+    if (!node) return;
+    if (level == key_levels) {
+        *leaves = grow(*leaves, capacity, *n + 1, sizeof (*leaves)[0]);
+        (*leaves)[(*n)++] = (Leaf) {
+            .row = (unsigned) (key >> 18) * tile_rows,
+            .col = (unsigned) (key & ((1 << 18) - 1)) * tile_cols,
+            .block = node
+        };
+        return;
+    }
+    const Branch *b = (const Branch *) node;
+    for (unsigned d = 0, i = 0; d < 1 << key_bits; ++d)
+        if (b->present & (uint64_t) 1 << d)
+            list_blocks(leaves, n, capacity, b->kids[i++], level + 1,
+                        key << key_bits | d);
+}
+
+static void link_texts(Texts *block) {
+    block->prev = NULL;
+    block->next = all_texts;
+    if (all_texts) all_texts->prev = block;
+    all_texts = block;
+}
+
+static Shared *copy_texts(const Shared *shared) {
+    Texts *block = malloc(sizeof *block);
+    if (!block) panic("Out of memory");
+    memcpy(block, shared, sizeof *block);
+    block->shared.nusers = 1;
+    for (unsigned c = 0; c < tile_cols; ++c)
+        for (unsigned r = 0; r < tile_rows; ++r)
+            if (block->at[c][r]) ++block->at[c][r]->nusers;
+    link_texts(block);
+    return &block->shared;
+}
+
+static void drop_texts(Shared *shared) {
+    Texts *block = (Texts *) shared;
+    if (!clearing)
+        for (unsigned c = 0; c < tile_cols; ++c)
+            for (unsigned r = 0; r < tile_rows; ++r)
+                if (block->at[c][r]) uncount_text(block->at[c][r]);
+    if (block->prev) block->prev->next = block->next;
+    else all_texts = block->next;
+    if (block->next) block->next->prev = block->prev;
+    free(block);
+}
+
+static Shared *copy_computed(const Shared *shared) {
+    Computed *block = malloc(sizeof *block);
+    if (!block) panic("Out of memory");
+    memcpy(block, shared, sizeof *block);
+    block->shared.nusers = 1;
+    return &block->shared;
+}
+
+static void drop_computed(Shared *shared) {
+    free(shared);
+}
+
+// Give a new tile its blocks, empty, in the sheet's tries.
+static void add_blocks(Tile *tile) {
+    uint64_t key = tile_key(tile->row, tile->col);
+    Texts *texts = calloc(1, sizeof *texts);
+    Computed *computed = calloc(1, sizeof *computed);
+    if (!texts || !computed) panic("Out of memory");
+    texts->shared.nusers = computed->shared.nusers = 1;
+    memset(computed->states, no_formula_state, sizeof computed->states);
+    link_texts(texts);
+    *block_link(&live.texts, key) = &texts->shared;
+    *block_link(&live.computed, key) = &computed->shared;
+    tile->texts = texts;
+    tile->computed = computed;
+    tile->texts_own = texts_taken;
+    tile->computed_own = computed_taken;
+}
+
+// Return the tile's block of texts, or of states and values, made the
+// sheet's own so it may change. (Unless a version's been taken since
+// it last was, it still is.)
+static Texts *own_texts(Tile *tile) {
+    if (tile->texts_own != texts_taken) {
+        tile->texts = (Texts *) own_block(&live.texts,
+                                          tile_key(tile->row, tile->col),
+                                          copy_texts);
+        tile->texts_own = texts_taken;
+    }
+    return tile->texts;
+}
+
+static Computed *own_computed(Tile *tile) {
+    assert(!speculating);
+    if (tile->computed_own != computed_taken) {
+        tile->computed = (Computed *) own_block(&live.computed,
+                                                tile_key(tile->row, tile->col),
+                                                copy_computed);
+        tile->computed_own = computed_taken;
+    }
+    return tile->computed;
+}
+
+// Take a version of the sheet's texts only, returning its root.
+static Shared *take_texts(void) {
+    ++texts_taken;
+    if (live.texts) ++live.texts->nusers;
+    return live.texts;
+}
+
+// Take a version of the whole sheet.
+static Version take_version(void) {
+    ++computed_taken;
+    if (live.computed) ++live.computed->nusers;
+    return (Version) {.texts = take_texts(), .computed = live.computed};
+}
+
+static void drop_version(Version *v) {
+    drop_trie(v->texts, 0, drop_texts);
+    drop_trie(v->computed, 0, drop_computed);
+    *v = (Version) {0};
+}
+
+// The text of the cell at (row,col) in the texts at `texts`, or NULL.
+static const Text *text_in(const Shared *texts, unsigned row, unsigned col) {
+    const Texts *block = (const Texts *) find_block(texts, tile_key(row, col));
+    return block ? block->at[col % tile_cols][row % tile_rows] : NULL;
+}
+
+// The state of the cell at (row,col) in `v`, setting *value if valid.
+static unsigned state_in(const Version *v, Value *value,
+                         unsigned row, unsigned col) {
+    const Computed *block =
+        (const Computed *) find_block(v->computed, tile_key(row, col));
+    if (!block) return no_formula_state;
+    unsigned state = block->states[col % tile_cols][row % tile_rows];
+    if (state == valid_state)
+        *value = block->values[col % tile_cols][row % tile_rows];
+    return state;
+}
+
+// Add to *diff each cell whose text differs between the texts at `a`
+// and at `b`, under branches of `level` reached by the digits `key`.
+static void diff_texts(Addresses *diff, const Shared *a, const Shared *b,
+                       unsigned level, uint64_t key) {
+    if (a == b) return;
+    if (level == key_levels) {
+        static const Texts empty;
+        const Texts *s = a ? (const Texts *) a : &empty;
+        const Texts *t = b ? (const Texts *) b : &empty;
+        unsigned row = (unsigned) (key >> 18) * tile_rows;
+        unsigned col = (unsigned) (key & ((1 << 18) - 1)) * tile_cols;
+        for (unsigned c = 0; c < tile_cols; ++c)
+            for (unsigned r = 0; r < tile_rows; ++r)
+                if (s->at[c][r] != t->at[c][r])
+                    push_address(diff, row + r, col + c);
+        return;
+    }
+    const Branch *x = (const Branch *) a, *y = (const Branch *) b;
+    uint64_t xs = x ? x->present : 0, ys = y ? y->present : 0;
+    for (unsigned d = 0, i = 0, j = 0; d < 1 << key_bits; ++d) {
+        uint64_t bit = (uint64_t) 1 << d;
+        const Shared *s = xs & bit ? x->kids[i++] : NULL;
+        const Shared *t = ys & bit ? y->kids[j++] : NULL;
+        if (s || t)
+            diff_texts(diff, s, t, level + 1, key << key_bits | d);
+    }
+}
+
+// While some other thread reads the texts of a version, they mustn't
+// move (see compact_texts()). Those threads count themselves here.
+static pthread_mutex_t pinned_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned npinned;
+
+static void pin_texts(void) {
+    pthread_mutex_lock(&pinned_lock);
+    ++npinned;
+    pthread_mutex_unlock(&pinned_lock);
+}
+
+static void unpin_texts(void) {
+    pthread_mutex_lock(&pinned_lock);
+    --npinned;
+    pthread_mutex_unlock(&pinned_lock);
+}
+
+// Return true if no other thread reads texts, keeping it that way till
+// unhold_texts().
+static int hold_texts(void) {
+    pthread_mutex_lock(&pinned_lock);
+    if (!npinned) return 1;
+    pthread_mutex_unlock(&pinned_lock);
+    return 0;
+}
+
+static void unhold_texts(void) {
+    pthread_mutex_unlock(&pinned_lock);
+}
+
+
+// Indexes over columns, for aggregates over ranges of cells
+
+// A summary of the cells in some range.
+typedef struct Summary Summary;
+struct Summary {
+    Sum sum;                          // Over the cells that have values,
+    Value min, max;                   //  their sum, least and greatest;
+    unsigned count;                   //  how many there are;
+    unsigned stale, cycles, errors;   // how many have these states instead.
+};
+
+static const Summary nothing = {.sum = 0, .min = max_value, .max = -max_value};
+
+static void add_summary(Summary *s, const Summary *t) {
+    s->sum += t->sum;
+    if (t->min < s->min) s->min = t->min;
+    if (s->max < t->max) s->max = t->max;
+    s->count += t->count;
+    s->stale += t->stale;
+    s->cycles += t->cycles;
+    s->errors += t->errors;
+}
+
+// Add to *s the cells of a tile's column, in rows [top,bottom) of it.
+static void add_cells(Summary *s, const Tile *tile, unsigned col,
+                      unsigned top, unsigned bottom) {
+    const unsigned char *states = tile->computed->states[col % tile_cols];
+    const Value *values = tile->computed->values[col % tile_cols];
+    for (unsigned r = top; r < bottom; ++r)
+        switch (states[r]) {
+            case valid_state:
+                s->sum += values[r];
+                if (values[r] < s->min) s->min = values[r];
+                if (s->max < values[r]) s->max = values[r];
+                ++s->count;
+                break;
+            case no_formula_state: break;  // Empty cells and labels don't count.
+            case stale_state: ++s->stale; break;
+            case cycle_state: ++s->cycles; break;
+            default: ++s->errors;
+        }
+}
+
+// A column's index is a segment tree over its rows, with nodes only
+// where some cell below them is in use. The leaves summarize a tile's
+// worth of the column apiece; within a leaf we scan the cells.
+typedef struct Node Node;
+struct Node {
+    Summary summary;
+    Node *kids[2];       // malloced, or NULL if there's nothing there
+};
+
+// Which rows in a column some cell's value aggregates over.
+typedef struct RangeUse RangeUse;
+struct RangeUse {
+    unsigned top, bottom;
+    Address user;
+};
+
+// For lookup(): the cells with values in some rows of a column, sorted
+// by value, and for equal values bottom row first.
+typedef struct Key Key;
+struct Key {
+    Value value;
+    unsigned row;
+};
+
+typedef struct Table Table;
+struct Table {
+    unsigned top, bottom;       // The rows, inclusive.
+    Key *keys;                  // malloced
+    unsigned n, capacity;
+    Table *next;                // The column's next table.
+};
+
+typedef struct Index Index;
+struct Index {
+    Node *root;          // Spanning rows [0, max_rows), or NULL if empty.
+    RangeUse *uses;      // malloced
+    unsigned nuses, uses_capacity;
+    Table *tables;       // malloced, each, until one of their cells changes.
+};
+
+static Index **indexes;  // By column: malloced, or NULL for no index. 
+static unsigned nindexes;
+
+// Speculating threads may make tables, one at a time.
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_tables(Table *table) {
+    while (table) {
+        Table *next = table->next;
+        free(table->keys);
+        free(table);
+        table = next;
+    }
+}
+
+// Drop the tables of `index` that have `row` in them.
+static void drop_tables(Index *index, unsigned row) {
+    for (Table **link = &index->tables; *link; ) {
+        Table *table = *link;
+        if (table->top <= row && row <= table->bottom) {
+            *link = table->next;
+            table->next = NULL;
+            free_tables(table);
+        }
+        else
+            link = &table->next;
+    }
+}
+
+// Add to `table` the keys of column `col` under `node`, which spans
+// `span` rows from `lo`.
+static void add_keys(Table *table, const Node *node, unsigned lo,
+                     unsigned span, unsigned col) {
+    if (!node || !node->summary.count
+        || table->bottom < lo || lo + (span-1) < table->top)
+        return;
+    if (span == tile_rows) {
+        const Tile *tile = find_tile(lo, col);
+        for (unsigned r = 0; r < tile_rows; ++r)
+            if (table->top <= lo + r && lo + r <= table->bottom
+                && tile->computed->states[col % tile_cols][r] == valid_state) {
+                table->keys = grow(table->keys, &table->capacity,
+                                   table->n + 1, sizeof table->keys[0]);
+                table->keys[table->n++] = (Key) {
+                    .value = tile->computed->values[col % tile_cols][r], .row = lo + r
+                };
+            }
+        return;
+    }
+    add_keys(table, node->kids[0], lo,          span/2, col);
+    add_keys(table, node->kids[1], lo + span/2, span/2, col);
+}
+
+static int compare_keys(const void *x, const void *y) {
+    const Key *a = x, *b = y;
+    if (a->value != b->value) return a->value < b->value ? -1 : 1;
+    return a->row < b->row ? 1 : a->row > b->row ? -1 : 0;
+}
+
+// Add to *s the cells of column `col` in rows [top,bottom] that are
+// under `node`, which spans `span` rows from `lo`.
+static void query(Summary *s, const Node *node, unsigned lo, unsigned span,
+                  unsigned top, unsigned bottom, unsigned col) {
+    if (!node || bottom < lo || lo + (span-1) < top) return;
+    if (top <= lo && lo + (span-1) <= bottom)
+        add_summary(s, &node->summary);
+    else if (span == tile_rows)
+        add_cells(s, find_tile(lo, col), col, top < lo ? 0 : top - lo,
+                  bottom - lo < tile_rows ? bottom - lo + 1 : tile_rows);
+    else {
+        query(s, node->kids[0], lo,          span/2, top, bottom, col);
+        query(s, node->kids[1], lo + span/2, span/2, top, bottom, col);
+    }
+}
+
+// Like query(), but look for the first stale cell, setting *row to it.
+// Return true iff found.
+static int find_stale(unsigned *row, const Node *node, unsigned lo,
+                      unsigned span, unsigned top, unsigned bottom,
+                      unsigned col) {
+    if (!node || !node->summary.stale || bottom < lo || lo + (span-1) < top)
+        return 0;
+    if (span == tile_rows) {
+        const Tile *tile = find_tile(lo, col);
+        for (unsigned r = top < lo ? 0 : top - lo;
+             r < tile_rows && lo + r <= bottom; ++r)
+            if (tile->computed->states[col % tile_cols][r] == stale_state) {
+                *row = lo + r;
+                return 1;
+            }
+        return 0;
+    }
+    return find_stale(row, node->kids[0], lo,          span/2, top, bottom, col)
+        || find_stale(row, node->kids[1], lo + span/2, span/2, top, bottom, col);
+}
+
+// Bring the index of column `col`, if any, up to date with the cell
+// at (row,col).
+static void reindex(unsigned row, unsigned col) {
+    if (nindexes <= col || !indexes[col]) return;
+    if (indexes[col]->tables) drop_tables(indexes[col], row);
+    Node *path[32];
+    unsigned depth = 0;
+    Node **link = &indexes[col]->root;
+    for (unsigned lo = 0, span = max_rows; ; span /= 2) {
+        if (!*link) {
+            *link = calloc(1, sizeof **link);
+            if (!*link) panic("Out of memory");
+        }
+        path[depth++] = *link;
+        if (span == tile_rows) break;
+        int kid = lo + span/2 <= row;
+        if (kid) lo += span/2;
+        link = &(*link)->kids[kid];
+    }
+    Summary s = nothing;
+    const Tile *tile = find_tile(row, col);
+    if (tile) add_cells(&s, tile, col, 0, tile_rows);
+    path[--depth]->summary = s;
+    while (0 < depth) {
+        Node *node = path[--depth];
+        node->summary = nothing;
+        for (int kid = 0; kid < 2; ++kid)
+            if (node->kids[kid])
+                add_summary(&node->summary, &node->kids[kid]->summary);
+    }
+}
+
+// Reindex every tile's worth of column `col`, or of all indexed columns.
+static void reindex_tiles(unsigned col, int all) {
+    for (unsigned i = 0; i < tiles_size; ++i)
+        if (tiles[i])
+            for (unsigned c = tiles[i]->col; c < tiles[i]->col + tile_cols; ++c)
+                if (all || c == col)
+                    reindex(tiles[i]->row, c);
+}
+
+// Return the table of rows [top,bottom] of column `col`, whose index
+// is `index`, making it if need be. Its cells must be up to date.
+static const Table *get_table(Index *index, unsigned top, unsigned bottom,
+                              unsigned col) {
+    Table *table = index->tables;
+    while (table && (table->top != top || table->bottom != bottom))
+        table = table->next;
+    if (!table) {
+        table = calloc(1, sizeof *table);
+        if (!table) panic("Out of memory");
+        table->top = top;
+        table->bottom = bottom;
+        add_keys(table, index->root, 0, max_rows, col);
+        qsort(table->keys, table->n, sizeof table->keys[0], compare_keys);
+        table->next = index->tables;
+        index->tables = table;
+    }
+    return table;
+}
+
+// Return column `col`'s index, making it if need be.
+static Index *get_index(unsigned col) {
+    if (nindexes <= col) {
+        unsigned n = nindexes;
+        indexes = grow(indexes, &nindexes, col + 1, sizeof indexes[0]);
+        memset(indexes + n, 0, (nindexes - n) * sizeof indexes[0]);
+    }
+    if (!indexes[col]) {
+        indexes[col] = calloc(1, sizeof *indexes[col]);
+        if (!indexes[col]) panic("Out of memory");
+        reindex_tiles(col, 0);
+    }
+    return indexes[col];
+}
+
+static void free_nodes(Node *node) {
+    if (!node) return;
+    free_nodes(node->kids[0]);
+    free_nodes(node->kids[1]);
+    free(node);
+}
+
+static void clear_indexes(void) {
+    for (unsigned c = 0; c < nindexes; ++c)
+        if (indexes[c]) {
+            free_nodes(indexes[c]->root);
+            free(indexes[c]->uses);
+            free_tables(indexes[c]->tables);
+            free(indexes[c]);
+        }
+    free(indexes);
+    indexes = NULL;
+    nindexes = 0;
+}
+
+static void use_range(Range range, Address user) {
+    for (unsigned c = range.left; c <= range.right; ++c) {
+        Index *index = get_index(c);
+        index->uses = grow(index->uses, &index->uses_capacity,
+                           index->nuses + 1, sizeof index->uses[0]);
+        index->uses[index->nuses++] = (RangeUse) {
+            .top = range.top, .bottom = range.bottom, .user = user
+        };
+    }
+}
+
+static void unuse_range(Range range, Address user) {
+    for (unsigned c = range.left; c <= range.right; ++c) {
+        Index *index = get_index(c);
+        for (unsigned i = 0; i < index->nuses; ++i) {
+            const RangeUse *use = &index->uses[i];
+            if (use->top == range.top && use->bottom == range.bottom
+                && use->user.row == user.row && use->user.col == user.col) {
+                index->uses[i] = index->uses[--index->nuses];
+                break;
+            }
+        }
+    }
+}
+
+
+// Keeping cell values up to date
+
+// The cells that went stale since the last recalculate_all(), each once.
+// (Some may have been recalculated since.)
+static Addresses stale_list;
+static unsigned stale_sorted;  // How much of it came in sorted order.
+
+// The cells whose texts were set since the sheet was last read or
+// saved, each once. (Some may have been set back since.)
+static Addresses dirty_list;
+static unsigned long nedits;  // How many times the user has set a text.
+
+// What the user did to the texts, to undo (see "Undoing and redoing").
+typedef struct History History;
+struct History {
+    Shared **versions;        // malloced: the texts as of each step,
+    unsigned nversions, versions_capacity;  //  oldest first;
+    unsigned now;             //  the one the sheet's at;
+    int changed;              //  and whether it's changed since.
+};
+
+static History history;
+static int keeping_history;   // Whether to (only for the UI).
+
+static void forget_history(void);
+
+static void list_stale(Cell *cell, unsigned row, unsigned col) {
+    if (!cell->listed) {
+        cell->listed = 1;
+        push_address(&stale_list, row, col);
+    }
+}
+
+// Invalidate any cached cell values, because a formula might have changed.
+static void text_updated(void) {
+    for (unsigned i = 0; i < tiles_size; ++i)
+        if (tiles[i]) {
+            memset(own_computed(tiles[i])->states, stale_state,
+                   sizeof tiles[i]->computed->states);
+            for (unsigned c = 0; c < tile_cols; ++c)
+                for (unsigned r = 0; r < tile_rows; ++r)
+                    list_stale(&tiles[i]->cells[c][r],
+                               tiles[i]->row + r, tiles[i]->col + c);
+        }
+    reindex_tiles(0, 1);
+}
+
+static void forget_links(Cell *cell, unsigned row, unsigned col);
+static void spill(const Cell *cell);
+static void spread(void);
+static void await_writer(void);
+
+// Empty the whole sheet, as at startup.
+static void clear_sheet(void) {
+    await_writer();  // (If it's reading this sheet.)
+    for (unsigned i = 0; i < tiles_size; ++i)
+        if (tiles[i]) {
+            for (unsigned c = 0; c < tile_cols; ++c)
+                for (unsigned r = 0; r < tile_rows; ++r) {
+                    Cell *cell = &tiles[i]->cells[c][r];
+                    if (cell->elsewhere)
+                        forget_links(cell, tiles[i]->row + r, tiles[i]->col + c);
+                    release_code(cell->code);
+                    free(cell->refs.at);
+                    free(cell->ranges.at);
+                    free(cell->users.at);
+                }
+            free(tiles[i]);
+        }
+    free(tiles);
+    tiles = NULL;
+    tiles_size = ntiles = 0;
+    last_tile = NULL;
+    clearing = 1;
+    drop_version(&live);
+    forget_history();
+    clearing = 0;
+    assert(!all_texts);
+    clear_texts();
+    clear_indexes();
+    free(stale_list.at);
+    stale_list = (Addresses) {0};
+    stale_sorted = 0;
+    free(dirty_list.at);
+    dirty_list = (Addresses) {0};
+    spread();
+}
+
+// While this is set, spoil() notes what each cell was first (for the
+// server's reply; see "Server mode").
+static int noting_priors;
+static void note_prior(unsigned row, unsigned col);
+
+// Make the cell at (row,col) stale, and queue it to invalidate its users.
+static void spoil(Cell *cell, unsigned row, unsigned col, Addresses *pending) {
+    if (noting_priors) note_prior(row, col);
+    set_state(row, col, stale_state);
+    list_stale(cell, row, col);
+    reindex(row, col);
+    push_address(pending, row, col);
+    if (cell->elsewhere) spill(cell);
+}
+
+// Invalidate the cached values of `cells` and all the values computed
+// from them, directly or indirectly. The users of a stale cell are
+// always stale themselves, so we needn't look past any cell already
+// stale.
+static void invalidate_cells(const Addresses *cells) {
+    Addresses pending = {0};
+    for (unsigned i = 0; i < cells->n; ++i) {
+        Address a = cells->at[i];
+        Cell *cell = find_cell(a.row, a.col);
+        // (Without a cell, nothing could depend on it.)
+        if (cell) spoil(cell, a.row, a.col, &pending);
+    }
+    while (0 < pending.n) {
+        Address a = pending.at[--pending.n];
+        const Addresses *users = &get_cell(a.row, a.col)->users;
+        for (unsigned i = 0; i < users->n; ++i) {
+            Address u = users->at[i];
+            if (get_state(u.row, u.col) != stale_state)
+                spoil(get_cell(u.row, u.col), u.row, u.col, &pending);
+        }
+        if (a.col < nindexes && indexes[a.col]) {
+            const Index *index = indexes[a.col];
+            for (unsigned i = 0; i < index->nuses; ++i) {
+                const RangeUse *use = &index->uses[i];
+                if (use->top <= a.row && a.row <= use->bottom) {
+                    Address u = use->user;
+                    if (get_state(u.row, u.col) != stale_state)
+                        spoil(get_cell(u.row, u.col), u.row, u.col, &pending);
+                }
+            }
+        }
+    }
+    free(pending.at);
+    spread();
+}
+
+static void invalidate(unsigned row, unsigned col) {
+    Address a = {.row = row, .col = col};
+    Addresses cells = {.at = &a, .n = 1, .capacity = 1};
+    invalidate_cells(&cells);
+}
+
+static void relink(Cell *cell, unsigned r, unsigned c, Links *refs);
+static Sheet *switch_sheet(Sheet *sheet);
+
+// Replace the record of what e's cell refers to with what e found.
+// Usually a recalculation refers to the same cells as last time, and
+// then the users lists needn't change.
+static void depend(Evaluator *e) {
+    unsigned r = e->row, c = e->col;
+    Addresses *refs = &e->refs;
+    Ranges *ranges = &e->ranges;
+    Cell *cell = get_cell(r, c);
+    Address self = {.row = r, .col = c};
+    Addresses *old = &cell->refs;
+    if (same_addresses(old, refs))
+        free(refs->at);
+    else {
+        for (unsigned i = 0; i < old->n; ++i)
+            remove_address(&get_cell(old->at[i].row, old->at[i].col)->users,
+                           r, c);
+        for (unsigned i = 0; i < refs->n; ++i)
+            push_address(&get_cell(refs->at[i].row, refs->at[i].col)->users,
+                         r, c);
+        free(old->at);
+        *old = *refs;
+    }
+    Ranges *old_ranges = &cell->ranges;
+    if (same_ranges(old_ranges, ranges))
+        free(ranges->at);
+    else {
+        for (unsigned i = 0; i < old_ranges->n; ++i)
+            unuse_range(old_ranges->at[i], self);
+        for (unsigned i = 0; i < ranges->n; ++i)
+            use_range(ranges->at[i], self);
+        free(old_ranges->at);
+        *old_ranges = *ranges;
+    }
+    if (e->links.n || cell->elsewhere) relink(cell, r, c, &e->links);
+}
+
+// A formula, if it's given, follows the '=' prefix.
+static const char *find_formula(const char *s) {
+    const char *t = skip_blanks(s);
+    return *t == '=' ? t + 1 : NULL;
+}
+
+// Like set_text_only(), for the `length` bytes at `text`.
+static void set_bytes_only(unsigned row, unsigned col,
+                           const char *text, size_t length) {
+    assert(row < max_rows && col < max_cols);
+    if (!length && !find_cell(row, col)) return;  // Already empty.
+    Cell *cell = get_cell(row, col);
+    Tile *tile = find_tile(row, col);
+    Text **at = &tile->texts->at[col % tile_cols][row % tile_rows];
+    if (*at && (*at)->chars == text) return;
+    if (!loading) ++nedits;
+    if (!loading && !cell->dirty) {
+        cell->dirty = 1;
+        push_address(&dirty_list, row, col);
+    }
+    if (keeping_history && !loading) {
+        if (!history.nversions) {      // The sheet as it was before.
+            history.versions = grow(history.versions,
+                                    &history.versions_capacity, 1,
+                                    sizeof history.versions[0]);
+            history.versions[history.nversions++] = take_texts();
+        }
+        history.changed = 1;
+    }
+    at = &own_texts(tile)->at[col % tile_cols][row % tile_rows];
+    Text *old = *at;
+    Text *t = *at = length ? share_text(text, length) : NULL;
+    release_text(old);  // (Which can move t.)
+    release_code(cell->code);
+    const char *formula = t ? find_formula(get_text(row, col)) : NULL;
+    cell->code = formula ? share_code(formula) : NULL;
+}
+
+// (You should use set_text() by default; set_text_only() is for when
+// you want to amortize text_updated() over a whole batch of changes.)
+static void set_text_only(unsigned row, unsigned col, const char *text) {
+    set_bytes_only(row, col, text, strlen(text));
+}
+
+static void set_text(unsigned row, unsigned col, const char *text) {
+    profile.evals = profile.refs = 0;
+    set_text_only(row, col, text);
+    invalidate(row, col);
+}
+
+// Recalculation proceeds without recursion, through this stack of
+// evaluations each waiting on the one above it. It keeps the values
+// stacks of all the evaluations in one array.
+typedef struct Frame Frame;
+struct Frame {
+    Evaluator e;
+    unsigned base;       // Where e's values start in values_stack.
+    int batch;           // Whether to try evaluate_run() on it.
+    double began;        // When, if profiling.
+};
+static Frame *frames;           // malloced
+static unsigned nframes, frames_capacity;
+static Value *values_stack;     // malloced
+static unsigned nvalues, values_capacity;
+
+// The stack of frames is a depth-first walk of the references, so it
+// can find the cycles as it goes, by Tarjan's algorithm. A reference
+// to a cell still being recalculated, or already found to be in a
+// cycle through one, means a cycle through the cells on the stack
+// from there up. Each such cell's evaluation stops at it, and once
+// the frame at the bottom of the cycle finishes they're all found:
+// exactly the cells of the cycle have the "Cycle" plaint, and cells
+// that refer to them get the usual plaint of "" (see refer()).
+// These are the cells still waiting for their cycles to be found.
+static Addresses open_cycles;
+
+// Start evaluating the stale cell at (r,c), on top of the stack.
+static void begin(unsigned r, unsigned c) {
+    Cell *cell = get_cell(r, c);
+    unsigned depth = cell->code ? cell->code->depth + 1 : 0;
+    frames = grow(frames, &frames_capacity, nframes + 1, sizeof frames[0]);
+    values_stack = grow(values_stack, &values_capacity, nvalues + depth,
+                        sizeof values_stack[0]);
+    frames[nframes++] = (Frame) {
+        .e = {.row = r, .col = c, .plaint = NULL}, .base = nvalues,
+        // (A run takes cells sharing the code, so a code of its own
+        // can't head one.)
+        .batch = cell->code && cell->code->batchable && 1 < cell->code->nusers,
+        .began = profiling ? now() : 0
+    };
+    nvalues += depth;
+    cell->low = nframes;
+    set_state(r, c, cycle_state); // Provisionally.
+    reindex(r, c);
+}
+
+// Note that e's cell is in a cycle reaching down to frames[low-1].
+// The evaluation goes on, to find any more of the cycle that the rest
+// of the formula refers to, but its outcome is the plaint "Cycle".
+static void join_cycle(Evaluator *e, unsigned low) {
+    if (!e->low || low < e->low) e->low = low;
+}
+
+// Return how far down the stack reaches a cycle through some cell in
+// `range` (the least of their lows), or 0 if none does. We look
+// through the range or through the cells with lows, whichever's less.
+static unsigned cycle_reach(Range range) {
+    unsigned low = 0;
+    unsigned long area = (unsigned long) (range.bottom - range.top + 1)
+                                       * (range.right - range.left + 1);
+    if (area <= nframes + open_cycles.n) {
+        for (unsigned c = range.left; c <= range.right; ++c)
+            for (unsigned r = range.top; r <= range.bottom; ++r) {
+                const Cell *cell = find_cell(r, c);
+                if (cell && cell->low && (!low || cell->low < low))
+                    low = cell->low;
+            }
+        return low;
+    }
+    for (unsigned i = 0; i < nframes && !low; ++i)
+        if (in_range(range, frames[i].e.row, frames[i].e.col))
+            low = i + 1;
+    for (unsigned i = 0; i < open_cycles.n; ++i) {
+        Address a = open_cycles.at[i];
+        unsigned l = find_cell(a.row, a.col)->low;
+        if (in_range(range, a.row, a.col) && (!low || l < low)) low = l;
+    }
+    return low;
+}
+
+// Once the evaluation at `frame` has finished: if it met a cycle
+// reaching further down the stack, its cell waits on open_cycles for
+// the rest of the cycle; if the cycle reaches only down to this
+// frame, then the cycle's all found, and the cells of it wait no more.
+static void settle(const Frame *frame) {
+    unsigned here = frame - frames + 1, low = frame->e.low;
+    Cell *cell = get_cell(frame->e.row, frame->e.col);
+    if (low && low < here) {
+        cell->low = low;
+        push_address(&open_cycles, frame->e.row, frame->e.col);
+        return;
+    }
+    cell->low = 0;
+    if (low)
+        while (0 < open_cycles.n) {
+            Address a = open_cycles.at[open_cycles.n-1];
+            Cell *member = get_cell(a.row, a.col);
+            if (member->low < here) break;
+            member->low = 0;
+            --open_cycles.n;
+        }
+}
+
+// The cell at `frame` heads a run down its tile's column: it and the
+// stale cells just below it that share its code. Those can often be
+// evaluated together, a lane per cell, each instruction going down the
+// lanes in a loop. A lane that refers to a stale cell, or to another
+// cell of the run, drops out, to get evaluated later by itself; if
+// it's the head that needs a stale cell, the run waits on it like any
+// other evaluation. Return 1 if the head got evaluated (with whichever
+// other lanes made it), 0 if it's waiting on e->awaited, or -1 if it's
+// no run after all.
+static Value *lane_values;      // malloced: each stack slot's lanes.
+static unsigned lane_values_capacity;
+
+static int evaluate_run(Frame *frame) {
+    unsigned r = frame->e.row, c = frame->e.col;
+    Tile *tile = find_tile(r, c);
+    Cell *cells = tile->cells[c % tile_cols];
+    unsigned top = r - tile->row;
+    Code *code = cells[top].code;
+    unsigned n = 1;
+    const unsigned char *states = tile->computed->states[c % tile_cols];
+    while (top + n < tile_rows && cells[top + n].code == code
+           && states[top + n] == stale_state)
+        ++n;
+    if (n < 2) return -1;
+
+    double t = profiling ? now() : 0;
+    Evaluator lanes[tile_rows];
+    for (unsigned j = 0; j < n; ++j)
+        lanes[j] = (Evaluator) {.row = r + j, .col = c, .plaint = NULL};
+    lane_values = grow(lane_values, &lane_values_capacity,
+                       (code->depth + 1) * tile_rows, sizeof lane_values[0]);
+    Value *sp = lane_values;      // Points just past the top slot.
+    for (const Instruction *pc = code->program;
+         pc < code->program + code->n; ++pc) {
+        int op = pc->op;
+        if (op == op_ref) {
+            // Push its coordinates, to do as an '@' below. (The stack
+            // has room, since they were pushed before compiling it.)
+            Value v = from_integer(pc->row + (pc->row_relative ? (long long) r : 0));
+            for (unsigned j = 0; j < n; ++j)
+                sp[j] = v + (pc->row_relative ? from_integer(j) : 0);
+            sp += tile_rows;
+            v = from_integer(pc->col + (pc->col_relative ? (long long) c : 0));
+            for (unsigned j = 0; j < n; ++j) sp[j] = v;
+            sp += tile_rows;
+            op = '@';
+        }
+        else if (op == op_push || op == op_row || op == op_col) {
+            Value v = op == op_push ? pc->operand
+                    : op == op_row  ? from_integer(r) + pc->operand
+                    : from_integer(c) + pc->operand;
+            for (unsigned j = 0; j < n; ++j) sp[j] = v;
+            if (op == op_row)
+                for (unsigned j = 0; j < n; ++j) sp[j] += from_integer(j);
+            sp += tile_rows;
+            continue;
+        }
+        Value *y = sp - tile_rows;
+        if (op == op_negate) {
+            for (unsigned j = 0; j < n; ++j) y[j] = -y[j];
+            continue;
+        }
+        Value *x = y - tile_rows;
+        switch (op) {
+#ifdef DECIMAL
+            // The commonest get checked inline.
+            case '+':
+                for (unsigned j = 0; j < n; ++j) {
+                    Value v;
+                    if (__builtin_add_overflow(x[j], y[j], &v)
+                        || v == overflowed)
+                        v = apply(&lanes[j], op, x[j], y[j]);
+                    x[j] = v;
+                }
+                break;
+            case '-':
+                for (unsigned j = 0; j < n; ++j) {
+                    Value v;
+                    if (__builtin_sub_overflow(x[j], y[j], &v)
+                        || v == overflowed)
+                        v = apply(&lanes[j], op, x[j], y[j]);
+                    x[j] = v;
+                }
+                break;
+            case '*':
+                for (unsigned j = 0; j < n; ++j) {
+                    Value v = multiply(x[j], y[j]);
+                    if (v == overflowed) v = apply(&lanes[j], op, x[j], y[j]);
+                    x[j] = v;
+                }
+                break;
+            case '^': case '/': case '%':
+#else
+            case '+': for (unsigned j = 0; j < n; ++j) x[j] += y[j]; break;
+            case '-': for (unsigned j = 0; j < n; ++j) x[j] -= y[j]; break;
+            case '*': for (unsigned j = 0; j < n; ++j) x[j] *= y[j]; break;
+            case '^':
+                for (unsigned j = 0; j < n; ++j) x[j] = pow(x[j], y[j]);
+                break;
+            case '/': case '%':
+#endif
+                for (unsigned j = 0; j < n; ++j)
+                    x[j] = apply(&lanes[j], op, x[j], y[j]);
+                break;
+            case '<': case '>': case '=': case op_le: case op_ge: case op_ne:
+                for (unsigned j = 0; j < n; ++j)
+                    x[j] = arithmetic(op, x[j], y[j]);
+                break;
+            case '@':
+                for (unsigned j = 0; j < n; ++j) {
+                    Evaluator *e = &lanes[j];
+                    if (e->plaint) continue;  // (As in evaluate().)
+                    if (y[j] == from_integer(c)
+                        && from_integer(r + (j == 0)) <= x[j]
+                        && x[j] < from_integer(r + n) && is_integer(x[j])) {
+                        // Within the run (besides the head back to
+                        // itself, which refer() finds is a cycle): most
+                        // likely the formula always refers down its own
+                        // column, like a running total, so don't batch
+                        // it again.
+                        code->batchable = 0;
+                        e->awaited = (Address) {.row = to_integer(x[j]),
+                                                .col = c};
+                        e->plaint = pending;
+                    }
+                    else
+                        x[j] = refer(e, x[j], y[j]);
+                }
+                break;
+            default: assert(0);
+        }
+        sp = y;
+    }
+
+    const Value *results = sp - tile_rows;
+    // A lane that met a cycle through the stack drops out too, to find
+    // whether it's in the cycle by itself.
+    for (unsigned j = 1; j < n; ++j)
+        if (lanes[j].low) lanes[j].plaint = pending;
+    if (lanes[0].plaint == pending) {
+        frame->e.awaited = lanes[0].awaited;
+        for (unsigned j = 0; j < n; ++j)
+            free(lanes[j].refs.at);
+        frame->batch = code->batchable;
+        return 0;
+    }
+    if (lanes[0].low) lanes[0].plaint = cycle;
+    frame->e.low = lanes[0].low;
+    unsigned ndone = 0;
+    for (unsigned j = 0; j < n; ++j)
+        ndone += lanes[j].plaint != pending;
+    double share = profiling ? (now() - t) / ndone : 0;
+    for (unsigned j = 0; j < n; ++j) {
+        Evaluator *e = &lanes[j];
+        if (e->plaint == pending) {
+            free(e->refs.at);
+            continue;
+        }
+        if (code->plaint) complain(e, code->plaint);
+        Cell *cell = &cells[top + j];
+        Computed *computed = own_computed(tile);
+        if (!e->plaint) computed->values[c % tile_cols][top + j] = results[j];
+        computed->states[c % tile_cols][top + j] = state_of(e->plaint);
+        cell->self_time += share;
+        cell->total_time += share;
+        ++cell->evals;
+        ++profile.evals;
+        profile.refs += e->refs.n;
+        reindex(e->row, c);
+        depend(e);
+        oops(e->plaint);
+    }
+    return 1;
+}
+
+// Run or resume the evaluation on top of the stack. Return true if it
+// finished, or false if it's waiting on e->awaited.
+static int recalculate(Frame *frame) {
+    if (frame->batch) {
+        int done = evaluate_run(frame);
+        if (0 <= done) return done;
+        frame->batch = 0;
+    }
+    Evaluator *e = &frame->e;
+    Tile *tile = find_tile(e->row, e->col);
+    Cell *cell = &tile->cells[e->col % tile_cols][e->row % tile_rows];
+    Computed *computed = own_computed(tile);
+    Value *value = &computed->values[e->col % tile_cols][e->row % tile_rows];
+    double t = profiling ? now() : 0;
+    const char *plaint = !cell->code ? no_formula
+        : evaluate(value, e, cell->code, values_stack + frame->base);
+    if (profiling) cell->self_time += now() - t;
+    if (plaint == pending) return 0;
+    if (e->low) plaint = cycle;
+    if (profiling) cell->total_time += now() - frame->began;
+    ++cell->evals;
+    ++profile.evals;
+    profile.refs += e->refs.n;
+    computed->states[e->col % tile_cols][e->row % tile_rows] = state_of(plaint);
+    reindex(e->row, e->col);
+    depend(e);
+    if (cell->code) oops(plaint);
+    return 1;
+}
+
+// Bring the cell at (r,c) up to date, along with whatever it depends on.
+// The order of evaluation (and so what cycles get found) comes out the
+// same as in the natural recursive scheme, but long chains of
+// references can't overflow the C stack.
+static void update(unsigned r, unsigned c) {
+    unsigned base = nframes, open = open_cycles.n;
+    begin(r, c);
+    while (base < nframes) {
+        Frame *frame = &frames[nframes-1];
+        if (recalculate(frame)) {
+            settle(frame);
+            nvalues = frame->base;
+            --nframes;
+        }
+        else if (!frame->e.awaited_sheet)
+            begin(frame->e.awaited.row, frame->e.awaited.col);
+        else {
+            // Bring it up to date over there, then try again. (That
+            // may come back here to update more of this sheet, on top
+            // of these frames.)
+            Sheet *sheet = frame->e.awaited_sheet;
+            Address a = frame->e.awaited;
+            frame->e.awaited_sheet = NULL;
+            Sheet *here = switch_sheet(sheet);
+            if (get_state(a.row, a.col) == stale_state) update(a.row, a.col);
+            switch_sheet(here);
+        }
+    }
+    // A cycle that came back here through another sheet may reach below
+    // where we began; it's all found that can be.
+    while (open < open_cycles.n) {
+        Address a = open_cycles.at[--open_cycles.n];
+        get_cell(a.row, a.col)->low = 0;
+    }
+}
+
+// Set *value to the value of the cell at (r,c), unless computing it
+// yields an error. Return the plaint.
+static const char *get_value(Value *value, unsigned r, unsigned c) {
+    if (max_rows <= r || max_cols <= c)
+        return "Cell out of range";
+    Tile *tile = find_tile(r, c);
+    if (!tile) return no_formula;
+    // (Updating can give the tile another block.)
+    if (get_state(r, c) == stale_state) update(r, c);
+    unsigned state = tile->computed->states[c % tile_cols][r % tile_rows];
+    if (state == valid_state)
+        *value = tile->computed->values[c % tile_cols][r % tile_rows];
+    return plaints[state];
+}
+
+// Check that an r or c coordinate names a row or column within `limit`.
+static int check_coordinate(Evaluator *e, Value v, unsigned limit) {
+    if (!is_integer(v))
+        complain(e, "Non-integer cell coordinate");
+    else if (!(0 <= v && v < from_integer(limit)))
+        complain(e, "Cell out of range");
+    else
+        return 1;
+    return 0;
+}
+
+// Refer to the value of the cell at (r,c), which is within the sheet.
+static Value refer_cell(Evaluator *e, unsigned r, unsigned c) {
+    const Tile *tile = find_tile(r, c);
+    unsigned state = tile ? tile->computed->states[c % tile_cols][r % tile_rows]
+                          : no_formula_state;
+    if (state == stale_state) {
+        e->awaited = (Address) {.row = r, .col = c};
+        complain(e, pending);
+        return 0;
+    }
+    push_address(&e->refs, r, c);
+    if (state == valid_state)
+        return tile->computed->values[c % tile_cols][r % tile_rows];
+    const char *plaint = plaints[state];
+    unsigned low = state == cycle_state ? find_cell(r, c)->low : 0;
+    if (low) join_cycle(e, low);
+    else complain(e, plaint == no_formula ? plaint : "");
+    // A plaint of "" is for when there's an error at the other end of
+    // the reference, but we don't want to redundantly report it here,
+    // ('here' meaning for the cell making the reference to the other
+    // cell) since the same plaint already shows over there in the
+    // cell-to-blame. That goes for a cycle too, unless this cell turns
+    // out to be in it.
+    return 0;
+}
+
+// The `r@c` operation in expressions, for row r, column c.
+static Value refer(Evaluator *e, Value r, Value c) {
+    if (!check_coordinate(e, r, max_rows) || !check_coordinate(e, c, max_cols))
+        return 0;
+    return refer_cell(e, to_integer(r), to_integer(c));
+}
+
+// The op_ref instruction: an `r@c` whose coordinates are known to be
+// whole numbers. (Only a relative one can be out of range, but a
+// snapshot's codes could say anything.)
+static Value refer_address(Evaluator *e, const Instruction *in) {
+    long long r = in->row + (in->row_relative ? (long long) e->row : 0);
+    long long c = in->col + (in->col_relative ? (long long) e->col : 0);
+    if (r < 0 || max_rows <= r || c < 0 || max_cols <= c) {
+        complain(e, "Cell out of range");
+        return 0;
+    }
+    return refer_cell(e, r, c);
+}
+
+// Aggregate over the range from corners[0]@corners[1] to
+// corners[2]@corners[3], according to `op`. Cells without values
+// don't count, like labels.
+// Set *range to the one with those corners, unless they're bad.
+// Return true if they're fine.
+static int get_range(Evaluator *e, Range *range, const Value *corners) {
+    for (int i = 0; i < 4; ++i)
+        if (!check_coordinate(e, corners[i], i % 2 ? max_cols : max_rows))
+            return 0;
+    unsigned r1 = to_integer(corners[0]), c1 = to_integer(corners[1]);
+    unsigned r2 = to_integer(corners[2]), c2 = to_integer(corners[3]);
+    *range = (Range) {.top  = r1 < r2 ? r1 : r2, .bottom = r1 < r2 ? r2 : r1,
+                      .left = c1 < c2 ? c1 : c2, .right  = c1 < c2 ? c2 : c1};
+    return 1;
+}
+
+// Add to *s the cells of `range`, and return true; unless we must wait
+// for some cell of it to be brought up to date, or for an index.
+static int summarize(Evaluator *e, Summary *s, Range range) {
+    for (unsigned c = range.left; c <= range.right; ++c) {
+        if (speculating && (nindexes <= c || !indexes[c])) {
+            // We may not make the index now; wait for it instead.
+            e->awaited = (Address) {.row = range.top, .col = c};
+            e->awaits_index = 1;
+            complain(e, pending);
+            return 0;
+        }
+        const Index *index = get_index(c);
+        unsigned r;
+        if (find_stale(&r, index->root, 0, max_rows,
+                       range.top, range.bottom, c)) {
+            e->awaited = (Address) {.row = r, .col = c};
+            complain(e, pending);
+            return 0;
+        }
+        query(s, index->root, 0, max_rows, range.top, range.bottom, c);
+    }
+    return 1;
+}
+
+static Value aggregate(Evaluator *e, int op, const Value *corners) {
+    Range range;
+    Summary s = nothing;
+    if (!get_range(e, &range, corners) || !summarize(e, &s, range))
+        return 0;
+    push_range(&e->ranges, range);
+    unsigned low = s.cycles ? cycle_reach(range) : 0;
+    if (low) join_cycle(e, low);
+    else if (s.cycles || s.errors) complain(e, "");  // (See refer().)
+    switch (op) {
+        case op_sum: {
+            Value sum = narrow(s.sum);
+            if (sum != overflowed) return sum;
+            complain(e, out_of_range);
+            return 0;
+        }
+        case op_count: return from_integer(s.count);
+        case op_min:
+        case op_max:
+            if (s.count == 0) complain(e, "No values in range");
+            return op == op_min ? s.min : s.max;
+        default: assert(0); return 0;
+    }
+}
+
+// lookup(key, top@left:bottom@right) finds the row where the range's
+// left column has the greatest value not above the key (the topmost
+// row, of equals), and comes to the value of that row's cell in the
+// right column: as in a table of tax brackets. The left column gets
+// searched in its Table, sorted once and kept until the column changes.
+static Value lookup(Evaluator *e, Value key, const Value *corners) {
+    Range range;
+    if (!get_range(e, &range, corners)) return 0;
+    Range keys = range;
+    keys.right = keys.left;
+    Summary s = nothing;
+    if (!summarize(e, &s, keys)) return 0;
+    Value value = 0;
+    unsigned low = s.cycles ? cycle_reach(keys) : 0;
+    if (low) join_cycle(e, low);
+    else if (s.cycles || s.errors) complain(e, "");  // (See refer().)
+    else {
+        if (speculating) pthread_mutex_lock(&tables_lock);
+        const Table *table = get_table(indexes[keys.left],
+                                       keys.top, keys.bottom, keys.left);
+        if (speculating) pthread_mutex_unlock(&tables_lock);
+        // Find the first key above `key`; the one before it is ours.
+        unsigned lo = 0, hi = table->n;
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo) / 2;
+            if (table->keys[mid].value <= key) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == 0)
+            complain(e, "Key below the lookup table");
+        else
+            value = refer_cell(e, table->keys[lo-1].row, range.right);
+    }
+    // (Once, though we may come back here after waiting on that cell.)
+    if (e->plaint != pending) push_range(&e->ranges, keys);
+    return value;
+}
+
+
+// Recalculating everything, in parallel if we may
+
+// Recalculating in parallel goes in rounds. In a round, each stale cell
+// gets evaluated speculatively, by whichever thread gets to it, while
+// the sheet stays unchanged. Those that needed no stale cell then get
+// their outcome committed, and the rest try again in the next round:
+// so each round does the next level of the dependency graph. A round
+// that finishes too few cells to be worth the trouble (in a long chain
+// of dependencies, for instance, or a cycle) ends this, and the rest
+// get recalculated one by one as usual.
+
+static unsigned nthreads = 1;  // How many threads recalculate_all() uses.
+
+typedef struct Outcome Outcome;
+struct Outcome {
+    Evaluator e;         // Its cell, and what the evaluation came to;
+    Value value;         //  the value, if e.plaint is NULL;
+    double time;         //  how long it took, if profiling;
+    int done;            //  whether it finished.
+    int wants_index;     // Otherwise, whether it waits on an index.
+};
+
+typedef struct Worker Worker;
+struct Worker {
+    pthread_t thread;
+    pthread_mutex_t lock;       // Guarding lo and hi.
+    unsigned lo, hi;            // The outcomes to work out, in the round.
+    Value *stack;               // malloced
+    unsigned stack_capacity;
+};
+
+static Worker *workers;         // malloced, nthreads of them.
+static Outcome *outcomes;       // malloced
+static unsigned noutcomes, outcomes_capacity;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t round_begun = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t round_ended = PTHREAD_COND_INITIALIZER;
+static unsigned round_number;   // Counts the rounds begun.
+static unsigned nbusy;          // How many threads haven't finished it.
+
+static void speculate(Outcome *o, Worker *w) {
+    const Cell *cell = find_cell(o->e.row, o->e.col);
+    o->done = 1;
+    if (!cell->code) {
+        o->e.plaint = no_formula;
+        return;
+    }
+    w->stack = grow(w->stack, &w->stack_capacity, cell->code->depth + 1,
+                    sizeof w->stack[0]);
+    double t = profiling ? now() : 0;
+    const char *plaint = evaluate(&o->value, &o->e, cell->code, w->stack);
+    if (profiling) o->time += now() - t;
+    if (plaint == pending) {
+        o->done = 0;
+        o->wants_index = o->e.awaits_index;
+    }
+}
+
+// Take the next outcome to work out from w's share.
+static int take(Worker *w, unsigned *i) {
+    pthread_mutex_lock(&w->lock);
+    int ok = w->lo < w->hi;
+    if (ok) *i = w->lo++;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// Or, when that's used up, steal from the back of another's.
+static int steal(Worker *w, unsigned *i) {
+    for (unsigned k = 1; k < nthreads; ++k) {
+        Worker *victim = &workers[(w - workers + k) % nthreads];
+        pthread_mutex_lock(&victim->lock);
+        int ok = victim->lo < victim->hi;
+        if (ok) *i = --victim->hi;
+        pthread_mutex_unlock(&victim->lock);
+        if (ok) return 1;
+    }
+    return 0;
+}
+
+static void do_share(Worker *w) {
+    unsigned i;
+    while (take(w, &i) || steal(w, &i))
+        speculate(&outcomes[i], w);
+}
+
+static void *work(void *arg) {
+    Worker *w = arg;
+    unsigned rounds_seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (round_number == rounds_seen)
+            pthread_cond_wait(&round_begun, &pool_lock);
+        rounds_seen = round_number;
+        pthread_mutex_unlock(&pool_lock);
+        do_share(w);
+        pthread_mutex_lock(&pool_lock);
+        if (--nbusy == 0) pthread_cond_signal(&round_ended);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+static void start_workers(void) {
+    workers = calloc(nthreads, sizeof workers[0]);
+    if (!workers) panic("Out of memory");
+    for (unsigned k = 0; k < nthreads; ++k) {
+        pthread_mutex_init(&workers[k].lock, NULL);
+        // (The main thread does the work of workers[0].)
+        if (0 < k && pthread_create(&workers[k].thread, NULL, work, &workers[k]))
+            panic("Couldn't start a thread");
+    }
+}
+
+// Work out all the outcomes, sharing them out among the threads.
+static void run_round(void) {
+    for (unsigned k = 0; k < nthreads; ++k) {
+        workers[k].lo = (unsigned long) noutcomes * k / nthreads;
+        workers[k].hi = (unsigned long) noutcomes * (k+1) / nthreads;
+    }
+    speculating = 1;
+    pthread_mutex_lock(&pool_lock);
+    nbusy = nthreads - 1;
+    ++round_number;
+    pthread_cond_broadcast(&round_begun);
+    pthread_mutex_unlock(&pool_lock);
+    do_share(&workers[0]);
+    pthread_mutex_lock(&pool_lock);
+    while (0 < nbusy)
+        pthread_cond_wait(&round_ended, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    speculating = 0;
+}
+
+// Commit the finished outcomes, keeping the rest for the next round.
+// Return how many finished.
+static unsigned commit(void) {
+    unsigned n = 0;
+    for (unsigned i = 0; i < noutcomes; ++i) {
+        Outcome *o = &outcomes[i];
+        if (o->done) {
+            Cell *cell = get_cell(o->e.row, o->e.col);
+            // (Its total time counts only its own tries, here.)
+            cell->self_time += o->time;
+            cell->total_time += o->time;
+            ++cell->evals;
+            ++profile.evals;
+            profile.refs += o->e.refs.n;
+            Tile *tile = find_tile(o->e.row, o->e.col);
+            unsigned r = o->e.row % tile_rows, c = o->e.col % tile_cols;
+            Computed *computed = own_computed(tile);
+            computed->states[c][r] = state_of(o->e.plaint);
+            if (!o->e.plaint) computed->values[c][r] = o->value;
+            reindex(o->e.row, o->e.col);
+            depend(&o->e);
+            if (cell->code) oops(o->e.plaint);
+        }
+        else {
+            if (o->wants_index) get_index(o->e.awaited.col);
+            free(o->e.refs.at);
+            free(o->e.ranges.at);
+            outcomes[n++] = (Outcome) {
+                .e = {.row = o->e.row, .col = o->e.col, .plaint = NULL},
+                .time = o->time
+            };
+        }
+    }
+    unsigned finished = noutcomes - n;
+    noutcomes = n;
+    return finished;
+}
+
+// Order addresses by band of tile rows, then column-major within the
+// band: near enough to row-major to keep nearby cells together, while
+// runs of cells down a tile's column can go together (see
+// evaluate_run()).
+static int compare_addresses(const void *x, const void *y) {
+    const Address *a = x, *b = y;
+    unsigned band = a->row / tile_rows, b_band = b->row / tile_rows;
+    if (band != b_band) return band < b_band ? -1 : 1;
+    if (a->col != b->col) return a->col < b->col ? -1 : 1;
+    if (a->row != b->row) return a->row < b->row ? -1 : 1;
+    return 0;
+}
+
+static int compare_addresses_backwards(const void *x, const void *y) {
+    return compare_addresses(y, x);
+}
+
+// Bring every stale cell up to date.
+static void recalculate_all(void) {
+    // Take the cells still stale off the stale list, in order.
+    Addresses todo = stale_list;
+    stale_list = (Addresses) {0};
+    stale_sorted = 0;
+    unsigned n = 0;
+    for (unsigned i = 0; i < todo.n; ++i) {
+        Address a = todo.at[i];
+        get_cell(a.row, a.col)->listed = 0;
+        if (get_state(a.row, a.col) == stale_state) todo.at[n++] = a;
+    }
+    todo.n = n;
+    qsort(todo.at, todo.n, sizeof todo.at[0], compare_addresses);
+
+    if (1 < nthreads) {
+        outcomes = grow(outcomes, &outcomes_capacity, todo.n,
+                        sizeof outcomes[0]);
+        noutcomes = todo.n;
+        for (unsigned i = 0; i < todo.n; ++i)
+            outcomes[i] = (Outcome) {
+                .e = {.row = todo.at[i].row, .col = todo.at[i].col}
+            };
+        while (0 < noutcomes) {
+            run_round();
+            if (commit() < 16 * nthreads) break;
+        }
+        noutcomes = 0;
+    }
+    for (unsigned i = 0; i < todo.n; ++i) {
+        Value value;
+        get_value(&value, todo.at[i].row, todo.at[i].col);
+    }
+    free(todo.at);
+}
+
+
+// Bring up to date some of the cells on the stale list, about n of
+// them if we're sequential, or all of them if parallel. Return true
+// iff any are left.
+static int recalculate_some(unsigned n) {
+    if (1 < nthreads) {
+        if (0 < stale_list.n) recalculate_all();
+        return 0;
+    }
+    if (stale_sorted < stale_list.n) {
+        // Sorted backwards, since we take them from the end.
+        qsort(stale_list.at, stale_list.n, sizeof stale_list.at[0],
+              compare_addresses_backwards);
+        stale_sorted = stale_list.n;
+    }
+    for (; 0 < n && 0 < stale_list.n; --n) {
+        Address a = stale_list.at[--stale_list.n];
+        --stale_sorted;
+        get_cell(a.row, a.col)->listed = 0;
+        Value value;
+        if (get_state(a.row, a.col) == stale_state)
+            get_value(&value, a.row, a.col);
+    }
+    return 0 < stale_list.n;
+}
+
+
+// Undoing and redoing
+
+// Each step the user takes that sets texts (each key, in reactor_loop())
+// ends with a version of the sheet's texts, kept in its history (see
+// "Versions of the sheet"). Those share all they don't change, so a
+// step costs only the blocks it changed. Undoing or redoing goes to
+// the version before or after, setting just the cells that differ
+// from it, and then only what depends on those gets recalculated. A
+// new step after undoing forgets the steps undone.
+
+enum { max_steps = 1000 };  // We forget the oldest steps beyond this.
+
+static void drop_texts_version(Shared *texts) {
+    drop_trie(texts, 0, drop_texts);
+}
+
+// Drop the versions from the k'th on.
+static void drop_steps(unsigned k) {
+    while (k < history.nversions)
+        drop_texts_version(history.versions[--history.nversions]);
+}
+
+// Close the step going on, if any, keeping the sheet's texts as of now.
+static void end_step(void) {
+    History *h = &history;
+    if (!h->changed) return;
+    h->changed = 0;
+    drop_steps(h->now + 1);
+    if (h->nversions == max_steps + 1) {
+        drop_texts_version(h->versions[0]);
+        memmove(h->versions, h->versions + 1,
+                --h->nversions * sizeof h->versions[0]);
+    }
+    h->versions = grow(h->versions, &h->versions_capacity, h->nversions + 1,
+                       sizeof h->versions[0]);
+    h->versions[h->nversions++] = take_texts();
+    h->now = h->nversions - 1;
+}
+
+// Empty the history.
+static void forget_history(void) {
+    drop_steps(0);
+    free(history.versions);
+    history = (History) {0};
+}
+
+// Set the cells back (or forward) to their texts in the k'th version,
+// setting *at to the first cell that changed, if any.
+static void go_to_step(unsigned k, Address *at) {
+    History *h = &history;
+    Addresses set = {0};
+    diff_texts(&set, h->versions[h->now], h->versions[k], 0, 0);
+    int keeping = keeping_history;
+    keeping_history = 0;
+    for (unsigned i = 0; i < set.n; ++i) {
+        // (Setting a text may move the others, so look each one up anew.)
+        const Text *t = text_in(h->versions[k], set.at[i].row, set.at[i].col);
+        set_bytes_only(set.at[i].row, set.at[i].col,
+                       t ? t->chars : "", t ? t->length : 0);
+    }
+    keeping_history = keeping;
+    h->now = k;
+    profile.evals = profile.refs = 0;
+    invalidate_cells(&set);
+    if (set.n) *at = set.at[0];
+    free(set.at);
+}
+
+// Undo the last step not undone. Return false if there's none.
+static int undo(Address *at) {
+    end_step();
+    if (!history.now) return 0;
+    go_to_step(history.now - 1, at);
+    return 1;
+}
+
+// Redo the last step undone. Return false if there's none.
+static int redo(Address *at) {
+    end_step();
+    if (history.now + 1 >= history.nversions) return 0;
+    go_to_step(history.now + 1, at);
+    return 1;
+}
+
+
+// Entering or editing a line of text
+
+static char input[81];
+
+// After a key_paste, read the pasted text up to its end bracket into
+// b, as lines ending in '\n' whatever the terminal sent (usually '\r').
+// Of the other non-printing characters, only tabs are kept.
+static void read_paste(Buffer *b) {
+    static const char paste_end[] = ANSI "201~";
+    const size_t n = sizeof paste_end - 1;
+    put_bytes(b, "", 0);
+    for (int k, last = 0; (k = get_byte()) != EOF; last = k) {
+        char c = k == '\r' ? '\n' : k;
+        if ((k == '\n' && last == '\r')
+            || !(isprint(k) || k == '\t' || k == '\n' || k == '\r' || k == esc))
+            continue;
+        put_bytes(b, &c, 1);
+        if (n <= b->n && 0 == memcmp(b->chars + b->n - n, paste_end, n)) {
+            b->n -= n;
+            b->chars[b->n] = '\0';
+            return;
+        }
+    }
+}
+
+// Return true iff the user commits a change.
+static int edit_input(void) {
+    size_t p = strlen(input);
+    forget_line(plaint_line);
+    for (;;) {
+        // Redraw only once we've caught up with the typing.
+        if (!key_waiting(0)) {
+            printf("\r" CLEAR_LINE_RIGHT "? %s" SHOW_CURSOR, input);
+            fflush(stdout);
+        }
+        int key = get_key();
+        if (key == '\r' || key == EOF || key == 7)
+            printf(HIDE_CURSOR);
+        if (key == '\r' || key == EOF)
+            return 1;
+        else if (key == 7) // ctrl-G to abort
+            return 0;
+        else if (key == '\b' || key == 127) { // backspace
+            if (0 < p)
+                input[--p] = '\0';
+        }
+        else if (isprint(key) && p+1 < sizeof input) {
+            input[p++] = key;
+            input[p] = '\0';
+        }
+        else if (key == key_paste) {
+            // Take what fits, with line breaks and tabs as spaces.
+            Buffer pasted = {0};
+            read_paste(&pasted);
+            for (unsigned i = 0; i < pasted.n && p+1 < sizeof input; ++i)
+                if (pasted.chars[i] != esc)
+                    input[p++] = isprint(pasted.chars[i]) ? pasted.chars[i] : ' ';
+            input[p] = '\0';
+            free(pasted.chars);
+        }
+    }
+}
+
+
+// Snapshots: sheets in binary, with their values
+
+// A sheet file may instead be a snapshot of the sheet, along with all
+// we'd otherwise work out from it: the compiled codes, who refers to
+// whom, and the values and plaints. Then loading needs no parsing and
+// no recalculating. (Cells that were stale stay stale.) The file is of
+// native 32-bit words; its parts are
+//   a header: the magic bytes, the version, a byte-order mark, and
+//     the engine (see below);
+//   the texts, as the count of them and then each one, a string;
+//   the cells, as the count and then each one's row, col and text's
+//     number;
+// and then what only this engine can use:
+//   the plaints beyond the first four, as the count and the strings;
+//   the codes, as the count and then each one's formula, plaint
+//     (empty for none), depth, batchable flag, length, and instructions;
+//   for each cell in the same order, its code's number (or none),
+//     state, value, refs, and ranges.
+// A string is its length and then its bytes, padded to a word.
+// A snapshot from an engine that compiles or computes differently --
+// with decimal Values, say -- is stale to us: then we load only the
+// texts, and recalculate as for a text file.
+static const char snapshot_magic[8] = "VCSNAP\r\n";
+enum {
+    snapshot_version = 1,
+    byte_order_mark = 0x01020304,
+    // Bump the 6 on changes to Code.
+    snapshot_engine = decimal_places << 16 | 6 << 8 | sizeof(Value),
+};
+static const uint32_t none = ~0u;  // The number of no code.
+
+static int is_snapshot_name(const char *filename) {
+    size_t n = strlen(filename);
+    return 5 <= n && 0 == strcmp(filename + n - 5, ".snap");
+}
+
+static void put_word(FILE *file, uint32_t word) {
+    fwrite(&word, sizeof word, 1, file);
+}
+
+static void put_raw(FILE *file, const void *bytes, size_t n) {
+    static const char padding[4];
+    fwrite(bytes, 1, n, file);
+    fwrite(padding, 1, -n % 4, file);
+}
+
+static void put_string(FILE *file, const char *s) {
+    size_t n = strlen(s);
+    put_word(file, n);
+    put_raw(file, s, n);
+}
+
+static int compare_pointers(const void *x, const void *y) {
+    uintptr_t p = (uintptr_t) *(void *const *)x;
+    uintptr_t q = (uintptr_t) *(void *const *)y;
+    return p < q ? -1 : p > q;
+}
+
+// Return the index of p in sorted[0..n), which must hold it.
+static unsigned find_pointer(void **sorted, unsigned n, const void *p) {
+    void **found = bsearch(&p, sorted, n, sizeof sorted[0], compare_pointers);
+    assert(found);
+    return found - sorted;
+}
+
+// Write the sheet as a snapshot to `file`.
+static void save_snapshot(FILE *file) {
+    // Number the texts and the codes, by sorting their addresses.
+    void **texts = malloc((ntexts + 1) * sizeof texts[0]);
+    void **codes = malloc((ncodes + 1) * sizeof codes[0]);
+    if (!texts || !codes) panic("Out of memory");
+    unsigned n = 0;
+    for (unsigned i = 0; i < texts_size; ++i)
+        for (Text *t = the_texts[i]; t; t = t->next)
+            texts[n++] = t;
+    assert(n == ntexts);
+    qsort(texts, ntexts, sizeof texts[0], compare_pointers);
+    n = 0;
+    for (unsigned i = 0; i < codes_size; ++i)
+        for (Code *code = the_codes[i]; code; code = code->next)
+            codes[n++] = code;
+    assert(n == ncodes);
+    qsort(codes, ncodes, sizeof codes[0], compare_pointers);
+
+    fwrite(snapshot_magic, sizeof snapshot_magic, 1, file);
+    put_word(file, snapshot_version);
+    put_word(file, byte_order_mark);
+    put_word(file, snapshot_engine);
+
+    put_word(file, ntexts);
+    for (unsigned i = 0; i < ntexts; ++i)
+        put_string(file, ((Text *) texts[i])->chars);
+
+    // The cells with texts are the ones to save; the rest are empty.
+    Tile **sorted = sort_tiles();
+    unsigned ncells = 0;
+    for (unsigned i = 0; i < ntiles; ++i)
+        for (unsigned c = 0; c < tile_cols; ++c)
+            for (unsigned r = 0; r < tile_rows; ++r)
+                ncells += sorted[i]->texts->at[c][r] != NULL;
+    put_word(file, ncells);
+    for (unsigned i = 0; i < ntiles; ++i)
+        for (unsigned c = 0; c < tile_cols; ++c)
+            for (unsigned r = 0; r < tile_rows; ++r) {
+                const Text *t = sorted[i]->texts->at[c][r];
+                if (!t) continue;
+                put_word(file, sorted[i]->row + r);
+                put_word(file, sorted[i]->col + c);
+                put_word(file, find_pointer(texts, ntexts, t));
+            }
+
+    put_word(file, nplaints - 4);
+    for (unsigned i = 4; i < nplaints; ++i)
+        put_string(file, plaints[i]);
+
+    put_word(file, ncodes);
+    for (unsigned i = 0; i < ncodes; ++i) {
+        const Code *code = codes[i];
+        put_string(file, code->formula);
+        put_string(file, orelse(code->plaint, ""));
+        put_word(file, code->depth);
+        put_word(file, code->batchable);
+        put_word(file, code->n);
+        for (unsigned j = 0; j < code->n; ++j) {
+            const Instruction *in = &code->program[j];
+            put_word(file, in->op);
+            put_word(file, in->row);
+            put_word(file, in->col);
+            put_word(file, in->row_relative | in->col_relative << 1);
+            put_raw(file, &in->operand, sizeof(Value));
+        }
+    }
+
+    for (unsigned i = 0; i < ntiles; ++i)
+        for (unsigned c = 0; c < tile_cols; ++c)
+            for (unsigned r = 0; r < tile_rows; ++r) {
+                const Cell *cell = &sorted[i]->cells[c][r];
+                if (!sorted[i]->texts->at[c][r]) continue;
+                put_word(file, cell->code
+                               ? find_pointer(codes, ncodes, cell->code)
+                               : none);
+                put_word(file, sorted[i]->computed->states[c][r]);
+                put_raw(file, &sorted[i]->computed->values[c][r], sizeof(Value));
+                put_word(file, cell->refs.n);
+                for (unsigned j = 0; j < cell->refs.n; ++j) {
+                    put_word(file, cell->refs.at[j].row);
+                    put_word(file, cell->refs.at[j].col);
+                }
+                put_word(file, cell->ranges.n);
+                for (unsigned j = 0; j < cell->ranges.n; ++j) {
+                    const Range *range = &cell->ranges.at[j];
+                    put_word(file, range->top);
+                    put_word(file, range->bottom);
+                    put_word(file, range->left);
+                    put_word(file, range->right);
+                }
+            }
+    free(sorted);
+    free(codes);
+    free(texts);
+}
+
+// Reading a snapshot goes through this, which notes running off the
+// end (or any other trouble) in `bad`, after which reads give 0s.
+typedef struct Reader Reader;
+struct Reader {
+    const char *p, *end;
+    int bad;
+};
+
+static void get_raw(Reader *in, void *dest, size_t n) {
+    size_t padded = n + -n % 4;
+    if (in->bad || (size_t) (in->end - in->p) < padded) {
+        in->bad = 1;
+        memset(dest, 0, n);
+        return;
+    }
+    memcpy(dest, in->p, n);
+    in->p += padded;
+}
+
+static uint32_t get_word(Reader *in) {
+    uint32_t word;
+    get_raw(in, &word, sizeof word);
+    return word;
+}
+
+// Return a count of things that take at least `size` bytes apiece in
+// what's left of the file. (So a bad count can't make us allocate much.)
+static unsigned get_count(Reader *in, size_t size) {
+    uint32_t n = get_word(in);
+    if ((size_t) (in->end - in->p) / size < n) in->bad = 1;
+    return in->bad ? 0 : n;
+}
+
+// Return where a string starts in the file, setting *n to its length.
+// (It's not null-terminated.)
+static const char *get_string(Reader *in, size_t *n) {
+    *n = get_count(in, 1);
+    const char *s = in->p;
+    if (!in->bad) in->p += *n + -*n % 4;
+    return s;
+}
+
+static int is_snapshot(const char *bytes, size_t size) {
+    return sizeof snapshot_magic <= size
+        && 0 == memcmp(bytes, snapshot_magic, sizeof snapshot_magic);
+}
+
+// Can evaluate() run `code`, from a snapshot, without going astray?
+// Its ops must be ones it knows, its jumps must go forward within it,
+// and the stack must neither run short nor outgrow code->depth, down
+// each way the branches go, ending with just the result on it. (Unless
+// it failed to compile: then it can stop anywhere.) Codes with op_call
+// or op_foreign don't come here; they get compiled afresh.
+static int is_sound(const Code *code) {
+    unsigned n = code->n;
+    int *depths = malloc((n + 1) * sizeof depths[0]);  // -1 until reached
+    if (!depths) panic("Out of memory");
+    for (unsigned j = 0; j <= n; ++j)
+        depths[j] = -1;
+    depths[0] = 0;
+    int sound = 1;
+    for (unsigned j = 0; j < n && sound; ++j) {
+        const Instruction *in = &code->program[j];
+        int depth = depths[j], pops = 0, pushes = 1;
+        if (depth < 0) continue;  // Jumped over.
+        switch (in->op) {
+            case op_push: case op_row: case op_col: case op_ref: break;
+            case op_negate: pops = 1; break;
+            case op_jump:   pushes = 0; break;
+            case op_branch: pops = 1; pushes = 0; break;
+            case op_sum: case op_min: case op_max: case op_count:
+                pops = 4;
+                break;
+            case op_lookup: pops = 5; break;
+            case '+': case '-': case '*': case '/': case '%': case '^':
+            case '@': case '<': case '>': case '=':
+            case op_le: case op_ge: case op_ne:
+                pops = 2;
+                break;
+            default: sound = 0; continue;
+        }
+        if (depth < pops || (int) code->depth < depth - pops + pushes) {
+            sound = 0;
+            break;
+        }
+        depth += pushes - pops;
+        unsigned next[2], nnext = 0;
+        if (in->op != op_jump)
+            next[nnext++] = j + 1;
+        if (in->op == op_jump || in->op == op_branch) {
+            Value target = in->operand;
+            if (!(j < target && target <= n && target == (unsigned) target)) {
+                sound = 0;
+                break;
+            }
+            next[nnext++] = (unsigned) target;
+        }
+        for (unsigned i = 0; i < nnext; ++i) {
+            if (depths[next[i]] < 0)
+                depths[next[i]] = depth;
+            else if (depths[next[i]] != depth)
+                sound = 0;
+        }
+    }
+    if (!code->plaint && depths[n] != 1) sound = 0;
+    free(depths);
+    return sound;
+}
+
+// Load the codes, states, values and dependencies of the cells (at
+// `cells`) that a fresh snapshot goes on to give.
+static void load_computed(Reader *in, const Addresses *cells) {
+    unsigned char states[256] = {valid_state, stale_state,
+                                 cycle_state, no_formula_state};
+    unsigned nstates = 4 + get_count(in, 4);
+    if (256 < nstates) in->bad = 1;
+    for (unsigned i = 4; i < nstates && !in->bad; ++i) {
+        size_t n;
+        const char *s = get_string(in, &n);
+        states[i] = state_named(s, n);
+    }
+
+    unsigned ncodes_in = get_count(in, 20), loaded = 0;
+    Code **codes = malloc((ncodes_in + 1) * sizeof codes[0]);
+    unsigned char *linking = calloc(ncodes_in + 1, 1);
+    if (!codes || !linking) panic("Out of memory");
+    for (; loaded < ncodes_in && !in->bad; ++loaded) {
+        size_t nformula, nplaint;
+        const char *formula = get_string(in, &nformula);
+        const char *plaint = get_string(in, &nplaint);
+        unsigned depth = get_word(in), batchable = get_word(in);
+        unsigned n = get_count(in, 16 + sizeof(Value));
+        if (in->bad || max_depth < depth) {
+            in->bad = 1;
+            break;
+        }
+        Code *code = malloc(sizeof *code + n * sizeof code->program[0]);
+        if (!code) panic("Out of memory");
+        code->plaint = nplaint ? plaints[state_named(plaint, nplaint)] : NULL;
+        code->depth = depth;
+        code->formula = dupe_bytes(formula, nformula);
+        code->nusers = 1;    // Until the cells count themselves in.
+        code->n = n;
+        for (unsigned j = 0; j < n; ++j) {
+            Instruction *instruction = &code->program[j];
+            instruction->op = get_word(in);
+            instruction->row = (int32_t) get_word(in);
+            instruction->col = (int32_t) get_word(in);
+            unsigned relative = get_word(in);
+            instruction->row_relative = relative & 1;
+            instruction->col_relative = relative >> 1 & 1;
+            get_raw(in, &instruction->operand, sizeof(Value));
+        }
+        code->batchable = batchable && is_batchable(code);
+        for (unsigned j = 0; j < n; ++j)
+            if (code->program[j].op == op_call
+                || code->program[j].op == op_foreign) {
+                // Sheet numbers hold only for the run that made them;
+                // and what other sheets hold may have changed since.
+                linking[loaded] = 1;
+                Code *fresh = compile(code->formula);
+                fresh->formula = code->formula;
+                fresh->nusers = 1;
+                free(code);
+                code = fresh;
+                break;
+            }
+        if (!linking[loaded] && !is_sound(code)) {
+            free(code->formula);
+            free(code);
+            in->bad = 1;
+            break;
+        }
+        add_code(code);
+        codes[loaded] = code;
+    }
+
+    Addresses linked = {0};  // The cells with such codes.
+    for (unsigned i = 0; i < cells->n && !in->bad; ++i) {
+        unsigned r = cells->at[i].row, c = cells->at[i].col;
+        Cell *cell = find_cell(r, c);
+        Computed *computed = own_computed(find_tile(r, c));
+        unsigned k = get_word(in), state = get_word(in);
+        get_raw(in, &computed->values[c % tile_cols][r % tile_rows], sizeof(Value));
+        if ((k != none && loaded <= k) || nstates <= state) {
+            in->bad = 1;
+            break;
+        }
+        if (k != none) {
+            cell->code = codes[k];
+            ++cell->code->nusers;
+            if (linking[k]) push_address(&linked, r, c);
+        }
+        computed->states[c % tile_cols][r % tile_rows] = states[state];
+        if (states[state] == stale_state) list_stale(cell, r, c);
+        unsigned nrefs = get_count(in, 8);
+        if (nrefs)
+            cell->refs.at = grow(cell->refs.at, &cell->refs.capacity, nrefs,
+                                 sizeof cell->refs.at[0]);
+        for (unsigned j = nrefs; j; --j) {
+            unsigned row = get_word(in), col = get_word(in);
+            if (max_rows <= row || max_cols <= col) in->bad = 1;
+            else push_address(&cell->refs, row, col);
+        }
+        unsigned nranges = get_count(in, 16);
+        if (nranges)
+            cell->ranges.at = grow(cell->ranges.at, &cell->ranges.capacity,
+                                   nranges, sizeof cell->ranges.at[0]);
+        for (unsigned j = nranges; j; --j) {
+            Range range;
+            range.top = get_word(in);
+            range.bottom = get_word(in);
+            range.left = get_word(in);
+            range.right = get_word(in);
+            if (range.bottom < range.top || max_rows <= range.bottom
+                || range.right < range.left || max_cols <= range.right)
+                in->bad = 1;
+            else
+                push_range(&cell->ranges, range);
+        }
+    }
+    for (unsigned i = 0; i < loaded; ++i)
+        release_code(codes[i]);
+    free(codes);
+    free(linking);
+    if (in->bad) {
+        free(linked.at);
+        return;
+    }
+
+    // Now that all the values are in, hook up the users.
+    for (unsigned i = 0; i < cells->n; ++i) {
+        Address self = cells->at[i];
+        const Cell *cell = find_cell(self.row, self.col);
+        for (unsigned j = 0; j < cell->refs.n; ++j) {
+            Address a = cell->refs.at[j];
+            push_address(&get_cell(a.row, a.col)->users, self.row, self.col);
+        }
+        for (unsigned j = 0; j < cell->ranges.n; ++j)
+            use_range(cell->ranges.at[j], self);
+    }
+    invalidate_cells(&linked);
+    free(linked.at);
+}
+
+// Load the snapshot of `size` bytes at `bytes` into the empty sheet.
+// Return 1 if done, 0 if only the cells' texts could be loaded (so the
+// caller must invalidate them all), or -1 if the snapshot is corrupt.
+static int load_snapshot(const char *bytes, size_t size) {
+    Reader reader = {.p = bytes + sizeof snapshot_magic, .end = bytes + size};
+    Reader *in = &reader;
+    if (get_word(in) != snapshot_version || get_word(in) != byte_order_mark)
+        return -1;
+    int fresh = get_word(in) == snapshot_engine;
+
+    unsigned ntexts_in = get_count(in, 4);
+    Text **texts = malloc((ntexts_in + 1) * sizeof texts[0]);
+    if (!texts) panic("Out of memory");
+    for (unsigned i = 0; i < ntexts_in; ++i) {
+        size_t n;
+        const char *s = get_string(in, &n);
+        texts[i] = share_text(s, n);  // Its user until the cells are in.
+    }
+
+    unsigned ncells = get_count(in, 12);
+    Addresses cells = {0};
+    for (unsigned i = 0; i < ncells && !in->bad; ++i) {
+        unsigned r = get_word(in), c = get_word(in), t = get_word(in);
+        if (max_rows <= r || max_cols <= c || ntexts_in <= t
+            || find_text(r, c)) {
+            in->bad = 1;
+            break;
+        }
+        get_cell(r, c);
+        own_texts(find_tile(r, c))->at[c % tile_cols][r % tile_rows] = texts[t];
+        ++texts[t]->nusers;
+        push_address(&cells, r, c);
+    }
+    for (unsigned i = 0; i < ntexts_in; ++i)
+        release_text(texts[i]);
+    free(texts);
+
+    if (fresh && !in->bad)
+        load_computed(in, &cells);
+    else if (!in->bad)
+        for (unsigned i = 0; i < cells.n; ++i) {
+            unsigned r = cells.at[i].row, c = cells.at[i].col;
+            const char *formula = find_formula(get_text(r, c));
+            find_cell(r, c)->code = formula ? share_code(formula) : NULL;
+        }
+    free(cells.at);
+    return in->bad ? -1 : fresh;
+}
+
+
+// Loading and saving of files
+
+static FILE *open_file(const char *filename, const char *mode,
+                       const char *plaint) {
+    FILE *file = fopen(filename, mode);
+    if (!file) oops(orelse(plaint, strerror(errno)));
+    return file;
+}
+
+static char spreadsheet_filename[1024]; // (wish I could use PATH_MAX)
+
+static void start_save(void);
+
+static void write_file(void) {
+    stuff(input, sizeof input, spreadsheet_filename);
+    if (!edit_input()) {
+        oops("Aborted");
+        return;
+    }
+    stuff(spreadsheet_filename, sizeof spreadsheet_filename, input);
+    start_save();
+}
+
+// Write the whole sheet to `file` as text, as of the version of its
+// texts at `texts`. (Any thread may, as long as the texts are pinned.)
+static void write_text(FILE *file, const Shared *texts) {
+    // Go through the blocks a band of rows at a time, to write row-major.
+    Leaf *leaves = NULL;
+    unsigned n = 0, capacity = 0;
+    list_blocks(&leaves, &n, &capacity, texts, 0, 0);
+    for (unsigned i = 0, j; i < n; i = j) {
+        for (j = i; j < n && leaves[j].row == leaves[i].row; ++j)
+            ;
+        for (unsigned r = 0; r < tile_rows; ++r)
+            for (unsigned k = i; k < j; ++k)
+                for (unsigned c = 0; c < tile_cols; ++c) {
+                    const Text *t = ((const Texts *) leaves[k].block)->at[c][r];
+                    const char *text = t ? t->chars : "";
+                    if (*skip_blanks(text))
+                        fprintf(file, "%u %u %s\n",
+                                leaves[k].row + r, leaves[k].col + c, text);
+                }
+    }
+    free(leaves);
+}
+
+// Return the contents of the open file fd, setting *size, and *mapped
+// to whether to munmap() them when done (else free()). A plain file
+// gets mapped into memory whole; anything else we read in big blocks.
+static char *slurp(int fd, size_t *size, int *mapped) {
+    struct stat st;
+    if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && 0 < st.st_size) {
+        char *bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytes != MAP_FAILED) {
+            posix_madvise(bytes, st.st_size, POSIX_MADV_SEQUENTIAL);
+            *size = st.st_size;
+            *mapped = 1;
+            return bytes;
+        }
+    }
+    char *bytes = NULL;
+    size_t n = 0, capacity = 0;
+    for (;;) {
+        if (n == capacity) {
+            capacity = capacity ? 2 * capacity : 1 << 20;
+            bytes = realloc(bytes, capacity);
+            if (!bytes) panic("Out of memory");
+        }
+        ssize_t got = read(fd, bytes + n, capacity - n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        n += got;
+    }
+    *size = n;
+    *mapped = 0;
+    return bytes;
+}
+
+// Scan a decimal number at p, if any, into *n, which saturates at
+// `limit`. Return where it ends.
+static const char *scan_number(const char *p, const char *end,
+                               unsigned *n, unsigned limit) {
+    unsigned long long v = 0;
+    for (; p < end && isdigit((unsigned char) *p); ++p)
+        v = v < limit ? 10 * v + (*p - '0') : limit;
+    *n = v < limit ? v : limit;
+    return p;
+}
+
+static const char *scan_blanks(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    return p;
+}
+
+// Scan the line from p to eol as "row col text", or maybe just "row
+// col". Return where the text starts (maybe at eol), or NULL if it's
+// not such a line.
+static const char *scan_record(const char *p, const char *eol,
+                               unsigned *r, unsigned *c) {
+    const char *q = scan_blanks(p, eol), *digits = q;
+    q = scan_number(q, eol, r, max_rows);
+    int ok = digits < q && q < eol && (*q == ' ' || *q == '\t');
+    q = scan_blanks(q, eol);
+    digits = q;
+    q = scan_number(q, eol, c, max_cols);
+    ok = ok && digits < q && (q == eol || *q == ' ' || *q == '\t');
+    return ok ? scan_blanks(q, eol) : NULL;
+}
+
+// Set the cells from the lines of `size` bytes at `bytes`, each line
+// "row col text" -- or in a journal, maybe just "row col", to empty
+// the cell. The texts go into the cells straight from the buffer, and
+// the invalidating is left to the caller, to do once. If `set` is
+// given, add to it the cells that got set.
+static void load_sheet(const char *bytes, size_t size, int journal,
+                       Addresses *set) {
+    const char *end = bytes + size;
+    for (const char *p = bytes; p < end; ) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        unsigned r, c;
+        const char *q = scan_record(p, eol, &r, &c);
+        if (!q || (q == eol && !journal))
+            oops("Bad line in file");
+        else if (max_rows <= r || max_cols <= c)
+            oops("Row or column number out of range in file");
+        else {
+            set_bytes_only(r, c, q, eol - q);
+            if (set) push_address(set, r, c);
+        }
+        p = eol + 1;
+    }
+}
+
+// Saving a sheet to a text file we've read it from (or already saved
+// it to) just appends the cells set since to the file's journal, named
+// like "checkbook.journal", and reading the file then replays that too.
+// Once the journal gets big, a save rewrites the file whole and empties
+// the journal. Replaying records the file already reflects does no
+// harm, so a crash at any point still leaves the file and journal
+// adding up to the last save.
+static char journal_base[sizeof spreadsheet_filename];  // or "" if none
+
+enum { journal_minimum = 64 * 1024 };  // Too small to bother compacting.
+
+static void name_with(char *name, size_t size,
+                      const char *filename, const char *suffix) {
+    if (size <= (size_t) snprintf(name, size, "%s%s", filename, suffix))
+        panic("Filename too long");
+}
+
+static void name_journal(char *name, size_t size, const char *filename) {
+    name_with(name, size, filename, ".journal");
+}
+
+// Apply the journal of spreadsheet_filename, if any. A last line that
+// got cut short (by a crash mid-save, presumably) is dropped, since
+// it was never fully saved.
+static void replay_journal(void) {
+    char name[sizeof spreadsheet_filename + 16];
+    name_journal(name, sizeof name, spreadsheet_filename);
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return;
+    size_t size;
+    int mapped;
+    char *bytes = slurp(fd, &size, &mapped);
+    close(fd);
+    size_t whole = size;
+    while (0 < whole && bytes[whole-1] != '\n') --whole;
+    load_sheet(bytes, whole, 1, NULL);
+    if (whole < size && truncate(name, whole) < 0)
+        oops(strerror(errno));
+    if (mapped) munmap(bytes, size);
+    else free(bytes);
+}
+
+// Write the whole sheet as text (as of `texts`) to a new file, and only
+// then put it in place of `filename`, so that no crash can leave half a
+// file. Return true on success.
+static int write_atomically(const char *filename, const Shared *texts) {
+    char name[sizeof spreadsheet_filename + 16];
+    name_with(name, sizeof name, filename, ".tmp");
+    FILE *file = fopen(name, "w");
+    if (!file) return 0;
+    write_text(file, texts);
+    int ok = 0 == fflush(file) && 0 == fsync(fileno(file));
+    ok = 0 == fclose(file) && ok;
+    if (ok && 0 == rename(name, filename)) return 1;
+    int error = errno;
+    unlink(name);
+    errno = error;
+    return 0;
+}
+
+static void clean_dirty_list(void) {
+    for (unsigned i = 0; i < dirty_list.n; ++i)
+        get_cell(dirty_list.at[i].row, dirty_list.at[i].col)->dirty = 0;
+    dirty_list.n = 0;
+}
+
+// Append the `dirty` cells to the journal of `base`; or if it's got big,
+// compact it into the file. Return true on success.
+static int append_journal(const char *base, const Shared *texts,
+                          const Addresses *dirty) {
+    char name[sizeof spreadsheet_filename + 16];
+    name_journal(name, sizeof name, base);
+    FILE *file = fopen(name, "a");
+    if (!file) return 0;
+    for (unsigned i = 0; i < dirty->n; ++i) {
+        Address a = dirty->at[i];
+        const Text *t = text_in(texts, a.row, a.col);
+        const char *text = t ? t->chars : "";
+        if (*skip_blanks(text))
+            fprintf(file, "%u %u %s\n", a.row, a.col, text);
+        else
+            fprintf(file, "%u %u\n", a.row, a.col);
+    }
+    // One sync for the whole batch of records.
+    int ok = 0 == fflush(file) && 0 == fsync(fileno(file));
+    off_t length = ftello(file);
+    ok = 0 == fclose(file) && ok;
+    if (!ok) return 0;
+    struct stat st;
+    if (journal_minimum <= length && 0 == stat(base, &st)
+        && st.st_size / 2 <= length && write_atomically(base, texts))
+        unlink(name);
+    return 1;
+}
+
+// How a save of texts went: saved_to_journal_base means the file can
+// have the journal from now on.
+enum { saved_to_journal_base, saved, save_failed };
+
+// Write the texts as of `texts` to `filename`: just the `dirty` cells,
+// if `journal` names the file the journal's for; else the whole sheet.
+// Return how it went, with errno set if it failed. (Any thread may.)
+static int save_texts(const char *filename, const char *journal,
+                      const Shared *texts, const Addresses *dirty) {
+    if (*journal && 0 == strcmp(journal, filename))
+        return append_journal(journal, texts, dirty)
+             ? saved_to_journal_base : save_failed;
+    // A file that isn't plain, like /dev/null, just gets written.
+    struct stat st;
+    if (0 == stat(filename, &st) && !S_ISREG(st.st_mode)) {
+        FILE *file = fopen(filename, "w");
+        if (!file) return save_failed;
+        write_text(file, texts);
+        return 0 == fclose(file) ? saved : save_failed;
+    }
+    if (!write_atomically(filename, texts)) return save_failed;
+    // A journal left over from some earlier sheet would now be wrong.
+    char name[sizeof spreadsheet_filename + 16];
+    name_journal(name, sizeof name, filename);
+    if (unlink(name) < 0 && errno != ENOENT) return save_failed;
+    return saved_to_journal_base;
+}
+
+// Write the sheet to spreadsheet_filename. Return true on success.
+static int save_file(void) {
+    if (is_snapshot_name(spreadsheet_filename)) {
+        FILE *file = open_file(spreadsheet_filename, "w", NULL);
+        if (!file) return 0;
+        save_snapshot(file);
+        fclose(file);
+        return 1;
+    }
+    int how = save_texts(spreadsheet_filename, journal_base, live.texts,
+                         &dirty_list);
+    if (how == save_failed) {
+        oops(strerror(errno));
+        return 0;
+    }
+    if (how == saved_to_journal_base) {
+        stuff(journal_base, sizeof journal_base, spreadsheet_filename);
+        clean_dirty_list();
+    }
+    return 1;
+}
+
+// Return false if there was no file to read.
+static int read_file(void) {
+    assert(*spreadsheet_filename); // Should be nonempty if we get here.
+    int fd = open(spreadsheet_filename, O_RDONLY);
+    if (fd < 0) {
+        oops("Fresh file");
+        return 0;
+    }
+    size_t size;
+    int mapped;
+    char *bytes = slurp(fd, &size, &mapped);
+    close(fd);
+    loading = 1;
+    int loaded = 0;
+    if (!is_snapshot(bytes, size)) {
+        load_sheet(bytes, size, 0, NULL);
+        replay_journal();
+        stuff(journal_base, sizeof journal_base, spreadsheet_filename);
+    }
+    else if ((loaded = load_snapshot(bytes, size)) < 0) {
+        clear_sheet();
+        oops("Bad snapshot file");
+        loaded = 0;
+    }
+    loading = 0;
+    if (!loaded) text_updated();
+    if (mapped) munmap(bytes, size);
+    else free(bytes);
+    return 1;
+}
+
+
+// Saving in the background
+
+// Saves from the UI happen in a thread of their own, writing from a
+// version of the sheet's texts (see "Versions of the sheet"), so the
+// disk may take as long as it likes while the sheet goes on changing.
+// (A snapshot needs more than texts, though: the codes and the links
+// between cells. That gets written by a forked child instead, which
+// has the sheet as of the fork to itself.) One writer writes at a time;
+// a save asked for meanwhile waits its turn. While there are changes
+// not yet saved, a writer also writes the whole sheet now and then to
+// "filename.unsaved", so that a crash can't lose much, and so does
+// quitting. A save removes it.
+static int writer;            // Whether a writer is writing:
+static pid_t writer_pid;      //  the child writing a snapshot, or 0 for
+static pthread_t writer_thread; //  this thread writing texts.
+static int writer_saving;     // Whether it's saving (else autosaving),
+static int writer_snapshot;   //  whether to a snapshot,
+static unsigned long writer_edits;  //  and nedits as of its version.
+static char writer_filename[sizeof spreadsheet_filename];
+
+// The sheet it's writing; and what the thread writes from: the texts
+// of a version of that, and its journal_base and dirty list as of then.
+static Sheet *writer_sheet;
+static Shared *writer_texts;
+static char writer_journal[sizeof journal_base];
+static Addresses writer_dirty;
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static int writer_done;       // Under the lock: whether the thread's done,
+static int writer_how;        //  and how it went, as a child's exit status.
+
+static int save_wanted;       // Whether a save awaits its turn,
+static char wanted_filename[sizeof spreadsheet_filename];  //  and to where.
+static unsigned long saved_edits, autosaved_edits;  // nedits as of each.
+static double autosaved_time; // When we last autosaved (or saved).
+
+enum { autosave_period = 30 };  // Seconds between autosaves.
+
+// (A writer's status is one of those of save_texts(), or save_failed
+// plus the errno.)
+
+static void name_unsaved(char *name, size_t size, const char *filename) {
+    name_with(name, size, *filename ? filename : "vicissicalc", ".unsaved");
+}
+
+static Sheet *the_sheet;
+static Sheet *switch_sheet(Sheet *sheet);
+
+static void *write_in_background(void *unused) {
+    (void) unused;
+    int how;
+    if (!writer_saving) {
+        char unsaved[sizeof spreadsheet_filename + 16];
+        name_unsaved(unsaved, sizeof unsaved, writer_filename);
+        how = write_atomically(unsaved, writer_texts) ? saved : save_failed;
+    } else {
+        how = save_texts(writer_filename, writer_journal, writer_texts,
+                         &writer_dirty);
+        if (how != save_failed) {
+            char unsaved[sizeof spreadsheet_filename + 16];
+            name_unsaved(unsaved, sizeof unsaved, writer_filename);
+            unlink(unsaved);
+        }
+    }
+    if (how == save_failed) how += errno ? min(errno, 250) : EIO;
+    pthread_mutex_lock(&writer_lock);
+    writer_how = how;
+    writer_done = 1;
+    pthread_mutex_unlock(&writer_lock);
+    return NULL;
+}
+
+// Start a writer saving to `filename`, or else autosaving.
+static void start_writer(int saving, const char *filename) {
+    writer_saving = saving;
+    writer_snapshot = saving && is_snapshot_name(filename);
+    writer_edits = nedits;
+    stuff(writer_filename, sizeof writer_filename, filename);
+    autosaved_time = now();
+    writer_sheet = the_sheet;
+    if (writer_snapshot) {
+        char unsaved[sizeof spreadsheet_filename + 16];
+        name_unsaved(unsaved, sizeof unsaved, filename);
+        pid_t pid = fork();
+        if (pid == 0) {
+            stuff(spreadsheet_filename, sizeof spreadsheet_filename, filename);
+            if (!save_file())
+                _exit(save_failed + (errno ? min(errno, 250) : EIO));
+            unlink(unsaved);
+            _exit(saved);
+        }
+        if (pid < 0) {
+            oops(strerror(errno));
+            return;
+        }
+        writer_pid = pid;
+        writer = 1;
+        return;
+    }
+    writer_texts = take_texts();
+    stuff(writer_journal, sizeof writer_journal, journal_base);
+    writer_dirty.n = 0;
+    if (saving)
+        for (unsigned i = 0; i < dirty_list.n; ++i)
+            push_address(&writer_dirty, dirty_list.at[i].row,
+                         dirty_list.at[i].col);
+    writer_done = 0;
+    pin_texts();
+    int error = pthread_create(&writer_thread, NULL, write_in_background, NULL);
+    if (error) {
+        unpin_texts();
+        drop_texts_version(writer_texts);
+        oops(strerror(error));
+        return;
+    }
+    writer = 1;
+    // The writer has the changes now; from here on, the dirty list
+    // collects the changes for the next save.
+    if (saving) clean_dirty_list();
+}
+
+// Take note of how the writer went, by its status `how`.
+static void note_written(int how) {
+    if (!writer_saving) {
+        if (how < save_failed) autosaved_edits = writer_edits;
+        else oops("Autosave failed");
+        return;
+    }
+    if (how < save_failed) {
+        saved_edits = autosaved_edits = writer_edits;
+        oops("File written"); // (The message is not really an oops, though.)
+    } else
+        oops(strerror(how - save_failed));
+    // The writer may have started the file's journal, or given up on it.
+    // (If what was dirty didn't get saved, the next save must write the
+    // file whole.)
+    if (how == saved_to_journal_base)
+        stuff(journal_base, sizeof journal_base, writer_filename);
+    else if (!writer_snapshot)
+        journal_base[0] = '\0';
+}
+
+// If the writer has finished (or once it does, if `block`), take note
+// of how it went. Return true if it had.
+static int reap_writer(int block) {
+    if (!writer) return 0;
+    int how;
+    if (writer_pid) {
+        int status;
+        if (waitpid(writer_pid, &status, block ? 0 : WNOHANG) != writer_pid)
+            return 0;
+        writer_pid = 0;
+        how = WIFEXITED(status) ? WEXITSTATUS(status) : save_failed + EIO;
+    } else {
+        pthread_mutex_lock(&writer_lock);
+        int done = writer_done;
+        pthread_mutex_unlock(&writer_lock);
+        if (!done && !block) return 0;
+        pthread_join(writer_thread, NULL);
+        how = writer_how;
+        unpin_texts();
+    }
+    writer = 0;
+    // (What follows is the business of the sheet it wrote.)
+    Sheet *was = switch_sheet(writer_sheet);
+    if (writer_texts) drop_texts_version(writer_texts);
+    writer_texts = NULL;
+    note_written(how);
+    switch_sheet(was);
+    return 1;
+}
+
+// Before the current sheet gets cleared: let a writer of it finish.
+static void await_writer(void) {
+    if (writer && writer_sheet == the_sheet)
+        reap_writer(1);
+}
+
+// Save to spreadsheet_filename, once any writer in progress is done.
+// (If a save to some other file is waiting already, that one can't
+// wait any longer.)
+static void start_save(void) {
+    if (writer && save_wanted
+        && 0 != strcmp(wanted_filename, spreadsheet_filename)) {
+        reap_writer(1);
+        start_writer(1, wanted_filename);
+    }
+    if (writer) {
+        save_wanted = 1;
+        stuff(wanted_filename, sizeof wanted_filename, spreadsheet_filename);
+        oops("Will write the file after the write in progress");
+    } else {
+        save_wanted = 0;
+        start_writer(1, spreadsheet_filename);
+        oops("Writing the file...");
+    }
+}
+
+// See to the writer: note whether it's done, start any save that was
+// waiting on it, and autosave if it's time. Return true if there's
+// news to show.
+static int tend_writer(void) {
+    int news = reap_writer(0);
+    if (!writer && save_wanted) {
+        save_wanted = 0;
+        start_writer(1, wanted_filename);
+        news = 1;
+    }
+    if (!writer && nedits != saved_edits && nedits != autosaved_edits
+        && autosave_period <= now() - autosaved_time)
+        start_writer(0, spreadsheet_filename);
+    return news;
+}
+
+// On quitting: let the writer finish, and do any save still wanted.
+// Then if there are changes unsaved, write the .unsaved file. Return
+// an exit status.
+static int finish_writing(void) {
+    reap_writer(1);
+    if (save_wanted) {
+        stuff(spreadsheet_filename, sizeof spreadsheet_filename,
+              wanted_filename);
+        if (save_file()) saved_edits = nedits;
+    }
+    if (nedits == saved_edits) return 0;
+    char unsaved[sizeof spreadsheet_filename + 16];
+    name_unsaved(unsaved, sizeof unsaved, spreadsheet_filename);
+    if (write_atomically(unsaved, live.texts)) return 0;
+    fprintf(stderr, "Couldn't write %s: %s\n", unsaved, strerror(errno));
+    return 1;
+}
+
+// Point out an .unsaved file left from before, if there is one.
+static void check_unsaved(void) {
+    char unsaved[sizeof spreadsheet_filename + 16];
+    name_unsaved(unsaved, sizeof unsaved, spreadsheet_filename);
+    if (0 == access(unsaved, F_OK))
+        oops("There are unsaved changes from before in the .unsaved file");
+    autosaved_time = now();
+}
+
+
+// Other sheets
+
+// Besides the sheet the user sees, a run can have other sheets loaded:
+// those that its formulas call, and those they refer to (see below).
+// Only the current sheet is in the globals. Each other sheet keeps its
+// share of them in its Sheet, till switch_sheet() swaps them in.
+typedef struct Memo Memo;
+
+struct Sheet {
+    char filename[sizeof spreadsheet_filename];
+    char journal_base[sizeof journal_base];
+    Tile **tiles;
+    unsigned tiles_size, ntiles;
+    Tile *last_tile;
+    Index **indexes;
+    unsigned nindexes;
+    Pool loaded_pool, edited_pool;
+    Text **the_texts;
+    unsigned texts_size, ntexts;
+    Addresses stale_list;
+    unsigned stale_sorted;
+    Addresses dirty_list;
+    unsigned long nedits, saved_edits, autosaved_edits;
+    double autosaved_time;
+    Frame *frames;
+    unsigned nframes, frames_capacity;
+    Value *values_stack;
+    unsigned nvalues, values_capacity;
+    Addresses open_cycles;
+    History history;
+    Version live;
+    Texts *all_texts;
+
+    // The rest is its own, whether current or not.
+    int loaded;          // Whether it's been read (or tried).
+    unsigned nusers;     // How many links to it from other sheets' cells.
+    int called;          // Whether it's a copy kept for call(), and then
+    int readable;        //  whether its file could be read,
+    int busy;            //  whether a call of it is in progress,
+    unsigned nbound;     //  how many input cells the last call set,
+    Memo **memos;        //  and a hash table of the calls' outcomes,
+    unsigned memos_size; //  with this many buckets (0 or a power of 2),
+    unsigned nmemos;     //  holding this many.
+};
+
+// The sheet the run began with, and the current one. While a sheet is
+// current, its Sheet holds nothing in particular.
+static Sheet first_sheet = {.loaded = 1};
+static Sheet *the_sheet = &first_sheet;
+
+#define swap(x, y) do {                           \
+        char t_[sizeof (x)];                      \
+        memcpy(t_, &(x), sizeof t_);              \
+        memcpy(&(x), &(y), sizeof t_);            \
+        memcpy(&(y), t_, sizeof t_);              \
+    } while (0)
+
+static void swap_sheet(Sheet *sheet) {
+    swap(spreadsheet_filename, sheet->filename);
+    swap(journal_base, sheet->journal_base);
+    swap(tiles, sheet->tiles);
+    swap(tiles_size, sheet->tiles_size);
+    swap(ntiles, sheet->ntiles);
+    swap(last_tile, sheet->last_tile);
+    swap(indexes, sheet->indexes);
+    swap(nindexes, sheet->nindexes);
+    swap(loaded_pool, sheet->loaded_pool);
+    swap(edited_pool, sheet->edited_pool);
+    swap(the_texts, sheet->the_texts);
+    swap(texts_size, sheet->texts_size);
+    swap(ntexts, sheet->ntexts);
+    swap(stale_list, sheet->stale_list);
+    swap(stale_sorted, sheet->stale_sorted);
+    swap(dirty_list, sheet->dirty_list);
+    swap(nedits, sheet->nedits);
+    swap(saved_edits, sheet->saved_edits);
+    swap(autosaved_edits, sheet->autosaved_edits);
+    swap(autosaved_time, sheet->autosaved_time);
+    swap(frames, sheet->frames);
+    swap(nframes, sheet->nframes);
+    swap(frames_capacity, sheet->frames_capacity);
+    swap(values_stack, sheet->values_stack);
+    swap(nvalues, sheet->nvalues);
+    swap(values_capacity, sheet->values_capacity);
+    swap(open_cycles, sheet->open_cycles);
+    swap(history, sheet->history);
+    swap(live, sheet->live);
+    swap(all_texts, sheet->all_texts);
+}
+
+// Make `sheet` the current sheet, returning the one that was.
+static Sheet *switch_sheet(Sheet *sheet) {
+    Sheet *was = the_sheet;
+    if (sheet != was) {
+        swap_sheet(was);
+        swap_sheet(sheet);
+        the_sheet = sheet;
+    }
+    return was;
+}
+
+static const char *sheet_name(const Sheet *sheet) {
+    return sheet == the_sheet ? spreadsheet_filename : sheet->filename;
+}
+
+// Return a new sheet for the file `filename` (of `length` bytes), not
+// read yet, in `*list` (of *n, growing).
+static Sheet *add_sheet(Sheet ***list, unsigned *n, unsigned *capacity,
+                        const char *filename, size_t length) {
+    Sheet *sheet = calloc(1, sizeof *sheet);
+    if (!sheet) panic("Out of memory");
+    char *name = dupe_bytes(filename, length);
+    stuff(sheet->filename, sizeof sheet->filename, name);
+    free(name);
+    *list = grow(*list, capacity, *n + 1, sizeof (*list)[0]);
+    (*list)[(*n)++] = sheet;
+    return sheet;
+}
+
+static int is_named(const Sheet *sheet, const char *filename, size_t length) {
+    const char *name = sheet_name(sheet);
+    return strlen(name) == length && 0 == memcmp(name, filename, length);
+}
+
+// Free all of the current sheet, to leave it as if never read.
+static void unload_sheet(void) {
+    clear_sheet();
+    free(frames);
+    frames = NULL;
+    frames_capacity = 0;
+    free(values_stack);
+    values_stack = NULL;
+    values_capacity = 0;
+    free(open_cycles.at);
+    open_cycles = (Addresses) {0};
+    the_sheet->loaded = 0;
+}
+
+
+// Calling other sheets as functions
+
+// call("tax", row, col, x, y, ...) comes to the value of the cell
+// row@col of the sheet in the file "tax", with its cells 0@0, 0@1, ...
+// set to x, y, .... The sheet gets read the first time, and then stays
+// loaded, a copy of its own apart from the workbook's. Each call's
+// outcome is remembered by its arguments, to answer the same call
+// again. A call that's new sets only the input cells whose values it
+// changes, so the called sheet recalculates only what depends on them,
+// and what the row@col cell needs.
+struct Memo {
+    Memo *next;          // The next in its bucket.
+    const char *plaint;  // The outcome: a plaint,
+    Value value;         //  or else this.
+    unsigned n;          // How many Values in the key:
+    Value key[];         //  row, col, and the arguments.
+};
+
+static Sheet **callees;  // malloced: each sheet called, by number.
+static unsigned ncallees, callees_capacity;
+
+// Return the number of the sheet in the file `filename` (of `length`
+// bytes), adding it to the callees if it's new.
+static unsigned callee_number(const char *filename, size_t length) {
+    for (unsigned i = 0; i < ncallees; ++i)
+        if (is_named(callees[i], filename, length))
+            return i;
+    add_sheet(&callees, &ncallees, &callees_capacity,
+              filename, length)->called = 1;
+    return ncallees - 1;
+}
+
+static Memo *find_memo(const Sheet *sheet, const Value *key, unsigned n,
+                       unsigned h) {
+    for (Memo *memo = sheet->memos_size ? sheet->memos[h & (sheet->memos_size-1)]
+                                        : NULL;
+         memo; memo = memo->next)
+        if (memo->n == n && 0 == memcmp(memo->key, key, n * sizeof key[0]))
+            return memo;
+    return NULL;
+}
+
+static Memo *add_memo(Sheet *sheet, const Value *key, unsigned n) {
+    if (sheet->memos_size <= 2 * sheet->nmemos) {
+        unsigned size = sheet->memos_size ? 2 * sheet->memos_size : 64;
+        Memo **memos = calloc(size, sizeof memos[0]);
+        if (!memos) panic("Out of memory");
+        for (unsigned i = 0; i < sheet->memos_size; ++i)
+            while (sheet->memos[i]) {
+                Memo *memo = sheet->memos[i];
+                sheet->memos[i] = memo->next;
+                unsigned j = hash_bytes((const char *) memo->key,
+                                        memo->n * sizeof memo->key[0]);
+                memo->next = memos[j & (size-1)];
+                memos[j & (size-1)] = memo;
+            }
+        free(sheet->memos);
+        sheet->memos = memos;
+        sheet->memos_size = size;
+    }
+    Memo *memo = malloc(sizeof *memo + n * sizeof memo->key[0]);
+    if (!memo) panic("Out of memory");
+    memo->n = n;
+    memcpy(memo->key, key, n * sizeof key[0]);
+    unsigned h = hash_bytes((const char *) key, n * sizeof key[0]);
+    memo->next = sheet->memos[h & (sheet->memos_size-1)];
+    sheet->memos[h & (sheet->memos_size-1)] = memo;
+    ++sheet->nmemos;
+    return memo;
+}
+
+// Set the input cells of the current sheet, which is `sheet`, to the
+// n values at `args`, invalidating what's computed from the ones that
+// change. Inputs the last call set and this one doesn't go back to
+// their own formulas.
+static void bind_inputs(Sheet *sheet, const Value *args, unsigned n) {
+    Addresses changed = {0};
+    for (unsigned i = 0; i < n; ++i) {
+        const Tile *tile = find_tile(0, i);
+        if (!tile || tile->computed->states[i % tile_cols][0] != valid_state
+            || tile->computed->values[i % tile_cols][0] != args[i])
+            push_address(&changed, 0, i);
+    }
+    for (unsigned i = n; i < sheet->nbound; ++i)
+        push_address(&changed, 0, i);
+    sheet->nbound = n;
+    invalidate_cells(&changed);
+    free(changed.at);
+    // (All of them, in case some inputs are computed from others.)
+    for (unsigned i = 0; i < n; ++i) {
+        get_cell(0, i);
+        Computed *computed = own_computed(find_tile(0, i));
+        computed->values[i % tile_cols][0] = args[i];
+        computed->states[i % tile_cols][0] = valid_state;
+        reindex(0, i);
+    }
+}
+
+// Bring the called sheet up to date for the call with `key` (row, col,
+// and the n-2 arguments), setting *value. Return the plaint.
+static const char *run_call(Sheet *sheet, const Value *key, unsigned n,
+                            Value *value) {
+    const char *plaint = the_plaint;
+    the_plaint = "";  // (Its plaints are its business, not the UI's.)
+    sheet->busy = 1;
+    Sheet *caller = switch_sheet(sheet);
+    if (!sheet->loaded) {
+        sheet->loaded = 1;
+        sheet->readable = *spreadsheet_filename && read_file();
+    }
+    const char *outcome = "Can't read the called sheet";
+    if (sheet->readable) {
+        bind_inputs(sheet, key + 2, n - 2);
+        outcome = get_value(value, to_integer(key[0]), to_integer(key[1]));
+    }
+    switch_sheet(caller);
+    sheet->busy = 0;
+    the_plaint = plaint;
+    if (outcome && (!*outcome || outcome == cycle))
+        outcome = "Error in the called sheet";
+    return outcome;
+}
+
+// The op_call instruction, with its row, col and arguments at `args`.
+static Value call_sheet(Evaluator *e, const Instruction *in,
+                        const Value *args) {
+    if (!check_coordinate(e, args[0], max_rows)
+        || !check_coordinate(e, args[1], max_cols))
+        return 0;
+    Sheet *sheet = callees[(unsigned) in->operand];
+    unsigned n = in->row + 2;
+    unsigned h = hash_bytes((const char *) args, n * sizeof args[0]);
+    Memo *memo = find_memo(sheet, args, n, h);
+    if (!memo) {
+        if (speculating) {
+            // We may not change the called sheet now. Wait on ourself,
+            // to be done by ourself later.
+            e->awaited = (Address) {.row = e->row, .col = e->col};
+            complain(e, pending);
+            return 0;
+        }
+        if (sheet->busy) {
+            complain(e, "Sheet calls itself");
+            return 0;
+        }
+        Value value = 0;
+        const char *plaint = run_call(sheet, args, n, &value);
+        memo = add_memo(sheet, args, n);
+        memo->plaint = plaint;
+        memo->value = value;
+    }
+    if (memo->plaint) complain(e, memo->plaint);
+    return memo->value;
+}
+
+
+// Workbooks
+
+// A formula can refer to a cell of another sheet by the name of its
+// file: "rates"!2@1 is the cell 2@1 of the sheet in the file "rates".
+// Such a sheet joins the workbook, to be read the first time a formula
+// needs it, and let go again (see release_sheets()) once no cell of
+// another sheet refers to it, unless it has unsaved changes. Every
+// reference between the workbook's sheets is a Link at either end, in
+// Elsewhere, like Cell.refs and Cell.users within a sheet, so that a
+// change in one sheet invalidates just what depends on it in the rest.
+static Sheet **sheets;   // malloced: the workbook, by number.
+static unsigned nsheets, sheets_capacity;
+
+// Return the number of the sheet in the file `filename` (of `length`
+// bytes), adding it to the workbook if it's new. The first sheet is
+// in the workbook from the start, if there are any others.
+static unsigned sheet_number(const char *filename, size_t length) {
+    if (nsheets == 0) {
+        sheets = grow(sheets, &sheets_capacity, 1, sizeof sheets[0]);
+        sheets[nsheets++] = &first_sheet;
+    }
+    for (unsigned i = 0; i < nsheets; ++i)
+        if (is_named(sheets[i], filename, length))
+            return i;
+    add_sheet(&sheets, &nsheets, &sheets_capacity, filename, length);
+    return nsheets - 1;
+}
+
+static void push_link(Links *links, Sheet *sheet, unsigned row, unsigned col) {
+    links->at = grow(links->at, &links->capacity, links->n + 1,
+                     sizeof links->at[0]);
+    links->at[links->n++] = (Link) {.sheet = sheet, .row = row, .col = col};
+}
+
+// Remove one occurrence of the link, if there is one, returning
+// whether there was. (Order isn't kept.)
+static int remove_link(Links *links, const Sheet *sheet,
+                       unsigned row, unsigned col) {
+    for (unsigned i = 0; i < links->n; ++i) {
+        const Link *link = &links->at[i];
+        if (link->sheet == sheet && link->row == row && link->col == col) {
+            links->at[i] = links->at[--links->n];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int same_links(const Links *a, const Links *b) {
+    return a->n == b->n
+        && (a->n == 0 || 0 == memcmp(a->at, b->at, a->n * sizeof a->at[0]));
+}
+
+static Elsewhere *get_elsewhere(Cell *cell) {
+    if (!cell->elsewhere) {
+        cell->elsewhere = calloc(1, sizeof *cell->elsewhere);
+        if (!cell->elsewhere) panic("Out of memory");
+    }
+    return cell->elsewhere;
+}
+
+// Take the current sheet's cell at (r,c) from the users of the cells
+// elsewhere that it refers to, emptying its refs.
+static void unlink_refs(Cell *cell, unsigned r, unsigned c) {
+    Sheet *here = the_sheet;
+    Links *refs = &cell->elsewhere->refs;
+    for (unsigned i = 0; i < refs->n; ++i) {
+        const Link *link = &refs->at[i];
+        switch_sheet(link->sheet);
+        Cell *there = find_cell(link->row, link->col);
+        if (there && there->elsewhere
+            && remove_link(&there->elsewhere->users, here, r, c))
+            --link->sheet->nusers;
+        switch_sheet(here);
+    }
+    refs->n = 0;
+}
+
+// Replace the record of what the current sheet's cell at (r,c) refers
+// to in other sheets with `refs`, as depend() does within the sheet.
+static void relink(Cell *cell, unsigned r, unsigned c, Links *refs) {
+    Elsewhere *old = cell->elsewhere;
+    if (old && same_links(&old->refs, refs)) {
+        free(refs->at);
+        return;
+    }
+    if (old) unlink_refs(cell, r, c);
+    Sheet *here = the_sheet;
+    for (unsigned i = 0; i < refs->n; ++i) {
+        const Link *link = &refs->at[i];
+        switch_sheet(link->sheet);
+        push_link(&get_elsewhere(get_cell(link->row, link->col))->users,
+                  here, r, c);
+        ++link->sheet->nusers;
+        switch_sheet(here);
+    }
+    Elsewhere *new = get_elsewhere(cell);
+    free(new->refs.at);
+    new->refs = *refs;
+    if (new->refs.n == 0 && new->users.n == 0) {
+        free(new->refs.at);
+        free(new->users.at);
+        free(new);
+        cell->elsewhere = NULL;
+    }
+}
+
+// The cells of other sheets to invalidate, as the users of cells
+// invalidated here.
+static Links spilled;
+
+static void spill(const Cell *cell) {
+    const Links *users = &cell->elsewhere->users;
+    for (unsigned i = 0; i < users->n; ++i)
+        push_link(&spilled, users->at[i].sheet, users->at[i].row,
+                  users->at[i].col);
+}
+
+// Invalidate the spilled cells, and whatever spills from them in turn.
+static void spread(void) {
+    static int spreading;
+    if (spreading) return;
+    spreading = 1;
+    while (0 < spilled.n) {
+        Link link = spilled.at[--spilled.n];
+        Sheet *here = switch_sheet(link.sheet);
+        if (get_state(link.row, link.col) != stale_state)
+            invalidate(link.row, link.col);
+        switch_sheet(here);
+    }
+    spreading = 0;
+}
+
+// Before the sheet's cell at (r,c) goes: take it out of the links.
+// What refers to it from elsewhere gets invalidated.
+static void forget_links(Cell *cell, unsigned r, unsigned c) {
+    unlink_refs(cell, r, c);
+    Sheet *here = the_sheet;
+    Links *users = &cell->elsewhere->users;
+    spill(cell);
+    for (unsigned i = 0; i < users->n; ++i) {
+        const Link *link = &users->at[i];
+        switch_sheet(link->sheet);
+        Cell *user = find_cell(link->row, link->col);
+        if (user && user->elsewhere)
+            remove_link(&user->elsewhere->refs, here, r, c);
+        switch_sheet(here);
+        --here->nusers;
+    }
+    free(cell->elsewhere->refs.at);
+    free(users->at);
+    free(cell->elsewhere);
+    cell->elsewhere = NULL;
+}
+
+// Read the workbook's `sheet` for the first time. A file that's not
+// there makes an empty sheet.
+static void load_lazily(Sheet *sheet) {
+    const char *plaint = the_plaint;
+    the_plaint = "";  // (Such as "Fresh file".)
+    Sheet *here = switch_sheet(sheet);
+    sheet->loaded = 1;
+    if (*spreadsheet_filename) read_file();
+    switch_sheet(here);
+    the_plaint = plaint;
+}
+
+// The op_foreign instruction: refer to the cell at (r,c) of the
+// workbook's sheet numbered `number`.
+static Value refer_foreign(Evaluator *e, unsigned number, Value r, Value c) {
+    if (!check_coordinate(e, r, max_rows) || !check_coordinate(e, c, max_cols))
+        return 0;
+    unsigned row = to_integer(r), col = to_integer(c);
+    Sheet *sheet = sheets[number];
+    if (sheet == the_sheet) return refer_cell(e, row, col);  // (By its name.)
+    if (speculating) {
+        // Switching sheets is for one thread alone. Wait on ourself,
+        // as in call_sheet().
+        e->awaited = (Address) {.row = e->row, .col = e->col};
+        complain(e, pending);
+        return 0;
+    }
+    if (the_sheet->called) {
+        complain(e, "A called sheet can't refer to other sheets");
+        return 0;
+    }
+    if (!sheet->loaded) load_lazily(sheet);
+    Sheet *here = switch_sheet(sheet);
+    const Tile *tile = find_tile(row, col);
+    unsigned state = tile ? tile->computed->states[col % tile_cols][row % tile_rows]
+                          : no_formula_state;
+    Value value = 0;
+    const char *plaint = NULL;
+    if (state == valid_state)
+        value = tile->computed->values[col % tile_cols][row % tile_rows];
+    else if (state == cycle_state && find_cell(row, col)->low)
+        plaint = cycle;  // It's in progress there: this is a cycle through it.
+    else if (state != stale_state)
+        plaint = plaints[state] == no_formula ? no_formula : "";
+    switch_sheet(here);
+    if (state == stale_state) {
+        e->awaited = (Address) {.row = row, .col = col};
+        e->awaited_sheet = sheet;
+        complain(e, pending);
+        return 0;
+    }
+    push_link(&e->links, sheet, row, col);
+    if (plaint) complain(e, plaint);
+    return value;
+}
+
+// Let go of the sheets of the workbook that nothing needs (see above),
+// besides the first. Letting go of one may leave another unneeded.
+static void release_sheets(void) {
+    for (int again = 1; again; ) {
+        again = 0;
+        for (unsigned i = 0; i < nsheets; ++i) {
+            Sheet *sheet = sheets[i];
+            if (sheet->loaded && sheet != &first_sheet && sheet != the_sheet
+                && sheet->nusers == 0 && sheet->nedits == sheet->saved_edits) {
+                Sheet *here = switch_sheet(sheet);
+                unload_sheet();
+                switch_sheet(here);
+                again = 1;
+            }
+        }
+    }
+}
+
+// Let go of all the workbook but the current sheet.
+static void close_workbook(void) {
+    for (unsigned i = 0; i < nsheets; ++i)
+        if (sheets[i]->loaded && sheets[i] != the_sheet) {
+            Sheet *here = switch_sheet(sheets[i]);
+            unload_sheet();
+            switch_sheet(here);
+        }
+}
+
+// Go on to the next sheet of the workbook, to see and edit it.
+static void next_sheet(void) {
+    unsigned i = 0;
+    while (i < nsheets && sheets[i] != the_sheet) ++i;
+    for (unsigned k = 1; k < nsheets; ++k) {
+        Sheet *sheet = sheets[(i + k) % nsheets];
+        if (sheet->loaded) {
+            // The writer's bookkeeping is the current sheet's.
+            while (writer) {
+                reap_writer(1);
+                tend_writer();
+            }
+            switch_sheet(sheet);
+            oops(*spreadsheet_filename ? spreadsheet_filename : "(no name)");
+            return;
+        }
+    }
+    oops("No other sheet");
+}
+
+// On quitting: finish the writing for each sheet of the workbook, the
+// current one first. Return an exit status.
+static int finish_workbook(void) {
+    int status = finish_writing();
+    for (unsigned i = 0; i < nsheets; ++i)
+        if (sheets[i]->loaded && sheets[i] != the_sheet) {
+            Sheet *here = switch_sheet(sheets[i]);
+            status |= finish_writing();
+            switch_sheet(here);
+        }
+    return status;
+}
+
+
+// Batch mode: recalculating sheets without a terminal
+
+static int csv;               // Whether to dump in CSV, else as "r c value".
+static unsigned nprocesses = 1;  // How many sheets to work on at once.
+
+static void put_csv_field(FILE *out, const char *s) {
+    if (!strpbrk(s, ",\"\r\n")) {
+        fputs(s, out);
+        return;
+    }
+    putc('"', out);
+    for (; *s; ++s) {
+        if (*s == '"') putc('"', out);
+        putc(*s, out);
+    }
+    putc('"', out);
+}
+
+// For the cell at (row,col) with `text`: if it's a formula, its value
+// (formatted into `number`) or plaint, else the text itself.
+static const char *shown_value(char number[32], unsigned row, unsigned col,
+                               const char *text) {
+    if (!find_formula(text)) return text;
+    Value value;
+    const char *plaint = get_value(&value, row, col);
+    if (!plaint) show_value(number, 32, value, 15);
+    return orelse(plaint, number);
+}
+
+// Write out every nonblank cell of the sheet, row-major: for a formula
+// its value or plaint, else its text.
+static void dump_sheet(FILE *out, const char *filename) {
+    Tile **sorted = sort_tiles();
+    for (unsigned i = 0, j; i < ntiles; i = j) {
+        for (j = i; j < ntiles && sorted[j]->row == sorted[i]->row; ++j)
+            ;
+        for (unsigned r = 0; r < tile_rows; ++r)
+            for (unsigned k = i; k < j; ++k)
+                for (unsigned c = 0; c < tile_cols; ++c) {
+                    unsigned row = sorted[k]->row + r, col = sorted[k]->col + c;
+                    const Text *t = sorted[k]->texts->at[c][r];
+                    const char *text = t ? t->chars : "";
+                    if (!*skip_blanks(text)) continue;
+                    char number[32];
+                    text = shown_value(number, row, col, text);
+                    if (csv) {
+                        put_csv_field(out, filename);
+                        fprintf(out, ",%u,%u,", row, col);
+                        put_csv_field(out, text);
+                        putc('\n', out);
+                    }
+                    else
+                        fprintf(out, "%u %u %s\n", row, col, text);
+                }
+    }
+    free(sorted);
+}
+
+typedef struct Cost Cost;
+struct Cost {
+    Address at;
+    const Cell *cell;
+};
+
+static int compare_costs(const void *x, const void *y) {
+    const Cost *a = x, *b = y;
+    if (a->cell->self_time != b->cell->self_time)
+        return a->cell->self_time < b->cell->self_time ? 1 : -1;
+    return a->at.row != b->at.row ? (a->at.row < b->at.row ? -1 : 1)
+         : a->at.col != b->at.col ? (a->at.col < b->at.col ? -1 : 1) : 0;
+}
+
+// Write the profile of every evaluated cell, costliest first, as
+// "filename: r c evals self-ms total-ms".
+static void dump_profile(FILE *out, const char *filename) {
+    Cost *cells = NULL;
+    unsigned n = 0, capacity = 0;
+    for (unsigned i = 0; i < tiles_size; ++i)
+        if (tiles[i])
+            for (unsigned c = 0; c < tile_cols; ++c)
+                for (unsigned r = 0; r < tile_rows; ++r) {
+                    const Cell *cell = &tiles[i]->cells[c][r];
+                    if (!cell->code || !cell->evals) continue;
+                    cells = grow(cells, &capacity, n + 1, sizeof cells[0]);
+                    cells[n++] = (Cost) {
+                        .at = {tiles[i]->row + r, tiles[i]->col + c},
+                        .cell = cell
+                    };
+                }
+    qsort(cells, n, sizeof cells[0], compare_costs);
+    for (unsigned i = 0; i < n; ++i)
+        fprintf(out, "%s: %u %u %u %.6f %.6f\n", filename,
+                cells[i].at.row, cells[i].at.col, cells[i].cell->evals,
+                cells[i].cell->self_time * 1e3,
+                cells[i].cell->total_time * 1e3);
+    fprintf(out, "%s: %lu evals, %lu refs\n",
+            filename, profile.evals, profile.refs);
+    free(cells);
+}
+
+// Load, recalculate, and dump one sheet, then forget it. Return false
+// on any trouble, which goes to stderr.
+static int run_batch(FILE *out, const char *filename) {
+    the_plaint = NULL;
+    stuff(spreadsheet_filename, sizeof spreadsheet_filename, filename);
+    int ok = read_file();
+    if (!ok)
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    else {
+        if (the_plaint) {
+            fprintf(stderr, "%s: %s\n", filename, the_plaint);
+            ok = 0;
+        }
+        profile.evals = profile.refs = 0;
+        recalculate_all();
+        dump_sheet(out, filename);
+        if (profiling) dump_profile(stderr, filename);
+    }
+    close_workbook();
+    clear_sheet();
+    return ok;
+}
+
+// Start a child process on the sheet in `filename`, returning the read
+// end of a pipe from it, and setting *pid to its process ID.
+static FILE *spawn_batch(pid_t *pid, const char *filename) {
+    int fds[2];
+    if (pipe(fds) < 0) panic(strerror(errno));
+    fflush(stdout);
+    *pid = fork();
+    if (*pid < 0) panic(strerror(errno));
+    if (*pid == 0) {
+        close(fds[0]);
+        FILE *out = fdopen(fds[1], "w");
+        if (!out) panic(strerror(errno));
+        if (1 < nthreads) start_workers();
+        int ok = run_batch(out, filename);
+        _exit(fclose(out) == 0 && ok ? 0 : 1);
+    }
+    close(fds[1]);
+    FILE *in = fdopen(fds[0], "r");
+    if (!in) panic(strerror(errno));
+    return in;
+}
+
+// Do each of the sheets, up to nprocesses of them at once. The output
+// comes in the order of the filenames regardless. Return an exit status.
+static int batch(int nfiles, char **filenames) {
+    int status = 0;
+    if (csv) printf("file,row,col,value\n");
+    if (nprocesses == 1) {
+        if (1 < nthreads) start_workers();
+        for (int i = 0; i < nfiles; ++i) {
+            if (!csv && 1 < nfiles) printf("# %s\n", filenames[i]);
+            if (!run_batch(stdout, filenames[i])) status = 1;
+        }
+        return status;
+    }
+    FILE **pipes = calloc(nfiles, sizeof pipes[0]);
+    pid_t *pids = calloc(nfiles, sizeof pids[0]);
+    if (!pipes || !pids) panic("Out of memory");
+    for (int i = 0, started = 0; i < nfiles; ++i) {
+        for (; started < nfiles && started < i + (int) nprocesses; ++started)
+            pipes[started] = spawn_batch(&pids[started], filenames[started]);
+        if (!csv && 1 < nfiles) printf("# %s\n", filenames[i]);
+        char chunk[4096];
+        size_t n;
+        while (0 < (n = fread(chunk, 1, sizeof chunk, pipes[i])))
+            fwrite(chunk, 1, n, stdout);
+        fclose(pipes[i]);
+        // (Not just any child: it's this pipe's exit status we want.)
+        int child;
+        if (waitpid(pids[i], &child, 0) < 0
+            || !WIFEXITED(child) || WEXITSTATUS(child))
+            status = 1;
+    }
+    free(pids);
+    free(pipes);
+    return status;
+}
+
+
+// Server mode: a warm sheet taking batches of changes over a socket
+
+// With -s socket, the sheet stays loaded, and the Unix socket at that
+// path takes batches of lines, each batch ending at a blank line (or
+// the end of the connection):
+//   "row col text" sets the cell to the text (or with none, empties it);
+//   "? row col" asks for the cell's value.
+// A batch's texts all go in first, and then it's one recalculation.
+// The reply is a line "row col value" for each cell that set, or whose
+// value or plaint that changed or first worked out (row-major; a value
+// as in batch mode), then
+// "? row col value" for each query, then a blank line. A bad line gets
+// "! plaint" instead. Meanwhile the socket "socket.read" takes queries
+// only, answered by a thread of their own from a version of the sheet
+// as of the last batch done (see "Versions of the sheet"): so readers
+// never see half a batch, nor wait on one. Changes don't get saved.
+
+typedef struct Prior Prior;
+struct Prior {
+    Address at;
+    unsigned char state; // stale_state for unknown: a cell not worked out
+    Value value;         //  yet, or one set by the batch. The value's
+};                       //  valid with valid_state.
+
+static Prior *priors;    // What the cells this batch spoiled had been.
+static unsigned npriors, priors_capacity;
+
+static void add_prior(unsigned row, unsigned col, unsigned state,
+                      Value value) {
+    priors = grow(priors, &priors_capacity, npriors + 1, sizeof priors[0]);
+    priors[npriors++] = (Prior) {.at = {row, col}, .state = state,
+                                 .value = value};
+}
+
+// (A cell can get noted more than once: the unknown goes first, below.)
+static void note_prior(unsigned row, unsigned col) {
+    if (the_sheet != &first_sheet) return;
+    const Tile *tile = find_tile(row, col);
+    add_prior(row, col, tile->computed->states[col % tile_cols][row % tile_rows],
+              tile->computed->values[col % tile_cols][row % tile_rows]);
+}
+
+static int compare_priors(const void *x, const void *y) {
+    const Prior *a = x, *b = y;
+    return a->at.row != b->at.row ? (a->at.row < b->at.row ? -1 : 1)
+         : a->at.col != b->at.col ? (a->at.col < b->at.col ? -1 : 1)
+         : (a->state != stale_state) - (b->state != stale_state);
+}
+
+static int has_text(unsigned r, unsigned c, const char *text, size_t n) {
+    const Text *t = find_text(r, c);
+    return t ? t->length == n && 0 == memcmp(t->chars, text, n) : n == 0;
+}
+
+// Like shown_value(), for the cell at (row,col) of the version `v`.
+static const char *shown_in(char number[32], const Version *v,
+                            unsigned row, unsigned col) {
+    const Text *t = text_in(v->texts, row, col);
+    const char *text = t ? t->chars : "";
+    if (!find_formula(text)) return text;
+    Value value;
+    unsigned state = state_in(v, &value, row, col);
+    if (state != valid_state) return plaints[state];
+    show_value(number, 32, value, 15);
+    return number;
+}
+
+// Add to *b the cell's line of a reply: from the version `v` if given,
+// else the sheet.
+static void put_shown(Buffer *b, const char *prefix, const Version *v,
+                      unsigned r, unsigned c) {
+    char number[32];
+    const char *shown = v ? shown_in(number, v, r, c)
+                          : shown_value(number, r, c, get_text(r, c));
+    put_format(b, "%s%u %u ", prefix, r, c);
+    put_bytes(b, shown, strlen(shown));
+    put_bytes(b, "\n", 1);
+}
+
+// Do the batch of lines from p to end, adding the reply to *reply (all
+// but its blank line). Only the writer may set cells; a reader answers
+// from the version `reading`. Return true if any got set.
+static int do_batch(Buffer *reply, const char *p, const char *end,
+                    const Version *reading) {
+    Addresses set = {0}, queries = {0};
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        const char *q = scan_blanks(p, eol);
+        int query = q < eol && *q == '?';
+        unsigned r, c;
+        const char *text = scan_record(query ? q + 1 : p, eol, &r, &c);
+        if (!text || (query && text < eol))
+            put_format(reply, "! Bad line: %.*s\n", (int) (eol - p), p);
+        else if (max_rows <= r || max_cols <= c)
+            put_format(reply, "! Row or column number out of range: %u %u\n",
+                       r, c);
+        else if (query)
+            push_address(&queries, r, c);
+        else if (reading)
+            put_format(reply, "! Only queries here: %u %u\n", r, c);
+        else if (!has_text(r, c, text, eol - text)) {
+            set_bytes_only(r, c, text, eol - text);
+            push_address(&set, r, c);
+        }
+        p = eol + 1;
+    }
+    if (set.n) {
+        // A cell set, or not worked out before, counts as changed: what
+        // it was shown as is unknown, or gone with its old text.
+        npriors = 0;
+        for (unsigned i = 0; i < set.n; ++i)
+            add_prior(set.at[i].row, set.at[i].col, stale_state, 0);
+        noting_priors = 1;
+        invalidate_cells(&set);
+        noting_priors = 0;
+        recalculate_all();
+        qsort(priors, npriors, sizeof priors[0], compare_priors);
+        for (unsigned i = 0; i < npriors; ++i) {
+            Address a = priors[i].at;
+            if (i && a.row == priors[i-1].at.row && a.col == priors[i-1].at.col)
+                continue;  // Noted already; an unknown sorts first.
+            const Tile *tile = find_tile(a.row, a.col);
+            unsigned state = tile->computed->states[a.col % tile_cols][a.row % tile_rows];
+            Value value = tile->computed->values[a.col % tile_cols][a.row % tile_rows];
+            if (state != priors[i].state
+                || (state == valid_state
+                    && memcmp(&value, &priors[i].value, sizeof value)))
+                put_shown(reply, "", NULL, a.row, a.col);
+        }
+    }
+    for (unsigned i = 0; i < queries.n; ++i)
+        put_shown(reply, "? ", reading, queries.at[i].row, queries.at[i].col);
+    free(queries.at);
+    free(set.at);
+    return set.n != 0;
+}
+
+typedef struct Client Client;
+struct Client {
+    int fd;
+    Buffer in;           // What's come in and not been answered yet,
+    unsigned scanned;    //  with no blank line in the first `scanned`.
+};
+
+typedef struct Clients Clients;
+struct Clients {
+    Client *at;          // malloced
+    unsigned n, capacity;
+};
+
+static int server_socket = -1, reader_socket = -1;
+
+// The version the reader thread answers from, as of the last batch;
+// and the ones before, to drop once it's not reading them.
+static pthread_mutex_t published_lock = PTHREAD_MUTEX_INITIALIZER;
+static Version *published;    // malloced, like each retired one.
+static const Version *reading;  // The one it's reading now, or NULL.
+static Version **retired;     // malloced
+static unsigned nretired, retired_capacity;
+
+// Give the reader the sheet as it is now, in place of the last.
+static void publish(void) {
+    Version *v = malloc(sizeof *v);
+    if (!v) panic("Out of memory");
+    *v = take_version();
+    pthread_mutex_lock(&published_lock);
+    if (published) {
+        retired = grow(retired, &retired_capacity, nretired + 1,
+                       sizeof retired[0]);
+        retired[nretired++] = published;
+    }
+    published = v;
+    for (unsigned i = 0; i < nretired; )
+        if (retired[i] == reading)
+            ++i;
+        else {
+            drop_version(retired[i]);
+            free(retired[i]);
+            retired[i] = retired[--nretired];
+        }
+    pthread_mutex_unlock(&published_lock);
+}
+
+// In the reader: take the version to read, till done_reading().
+static const Version *start_reading(void) {
+    pin_texts();
+    pthread_mutex_lock(&published_lock);
+    reading = published;
+    pthread_mutex_unlock(&published_lock);
+    return reading;
+}
+
+static void done_reading(void) {
+    pthread_mutex_lock(&published_lock);
+    reading = NULL;
+    pthread_mutex_unlock(&published_lock);
+    unpin_texts();
+}
+
+// Answer each whole batch come in from the client; and at the end of
+// its input, what's left as well.
+static void answer(Client *client, int writer, int at_end) {
+    Buffer *in = &client->in;
+    if (!in->n) return;
+    const Version *v = writer ? NULL : start_reading();
+    Buffer reply = {0};
+    int changed = 0;
+    unsigned start = 0;
+    for (;;) {
+        const char *p = in->chars + start, *end = in->chars + in->n;
+        const char *q = in->chars + client->scanned, *stop = NULL;
+        while (q < end) {
+            const char *eol = memchr(q, '\n', end - q);
+            if (!eol) break;
+            if (eol == q) { stop = q; break; }
+            q = eol + 1;
+        }
+        client->scanned = q - in->chars;
+        if (!stop) {
+            if (!at_end || p == end) break;
+            stop = end;
+        }
+        changed |= do_batch(&reply, p, stop, v);
+        put_bytes(&reply, "\n", 1);
+        start = client->scanned = min(stop + 1 - in->chars, in->n);
+    }
+    if (v) done_reading();
+    if (changed) publish();
+    for (unsigned sent = 0; sent < reply.n; ) {
+        ssize_t n = send(client->fd, reply.chars + sent, reply.n - sent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;  // The client's gone; so be it.
+        sent += n;
+    }
+    free(reply.chars);
+    memmove(in->chars, in->chars + start, in->n - start + 1);
+    in->n -= start;
+    client->scanned -= start;
+}
+
+// Take in what the i'th client sent, and answer it. Any batches from
+// a reader can't set cells.
+static void take_in(Clients *clients, unsigned i, int writer) {
+    Client *client = &clients->at[i];
+    char chunk[65536];
+    ssize_t n = read(client->fd, chunk, sizeof chunk);
+    if (n < 0 && errno == EINTR) return;
+    if (0 < n) put_bytes(&client->in, chunk, n);
+    answer(client, writer, n <= 0);
+    if (n <= 0) {
+        close(client->fd);
+        free(client->in.chars);
+        *client = clients->at[--clients->n];
+    }
+}
+
+// Serve the clients connecting at `listener`, for good: as the writer,
+// in the main thread, or else as the reader.
+static void serve(int listener, int writer) {
+    Clients clients = {0};
+    struct pollfd *fds = NULL;
+    unsigned fds_capacity = 0;
+    for (;;) {
+        unsigned m = clients.n;
+        fds = grow(fds, &fds_capacity, m + 1, sizeof fds[0]);
+        for (unsigned i = 0; i < m; ++i)
+            fds[i] = (struct pollfd) {.fd = clients.at[i].fd, .events = POLLIN};
+        fds[m] = (struct pollfd) {.fd = listener, .events = POLLIN};
+        if (poll(fds, m + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            panic(strerror(errno));
+        }
+        for (unsigned i = m; 0 < i--; )  // (Downward, as take_in() drops.)
+            if (fds[i].revents) take_in(&clients, i, writer);
+        if (fds[m].revents) {
+            int fd = accept(listener, NULL, NULL);
+            if (0 <= fd) {
+                clients.at = grow(clients.at, &clients.capacity,
+                                  clients.n + 1, sizeof clients.at[0]);
+                clients.at[clients.n++] = (Client) {.fd = fd};
+            }
+        }
+    }
+}
+
+static void *read_in_background(void *unused) {
+    (void) unused;
+    serve(reader_socket, 0);
+    return NULL;
+}
+
+static int listen_at(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (sizeof address.sun_path <= strlen(path)) panic("Socket path too long");
+    stuff(address.sun_path, sizeof address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) panic(strerror(errno));
+    unlink(path);  // Left from a server before, presumably.
+    if (bind(fd, (struct sockaddr *) &address, sizeof address) < 0
+        || listen(fd, 64) < 0)
+        panic(strerror(errno));
+    return fd;
+}
+
+// Serve the sheet in `filename` at the socket `path`, and its reader
+// socket, never returning.
+static int run_server(const char *path, const char *filename) {
+    stuff(spreadsheet_filename, sizeof spreadsheet_filename, filename);
+    if (!read_file())
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    else if (the_plaint)
+        fprintf(stderr, "%s: %s\n", filename, the_plaint);
+    the_plaint = NULL;
+    recalculate_all();
+    char name[sizeof spreadsheet_filename];
+    name_with(name, sizeof name, path, ".read");
+    server_socket = listen_at(path);
+    reader_socket = listen_at(name);
+    publish();
+    pthread_t reader;
+    int error = pthread_create(&reader, NULL, read_in_background, NULL);
+    if (error) panic(strerror(error));
+    serve(server_socket, 1);
+    return 0;
+}
+
+
+// UI display
+
+enum { colwidth = 18 };
+
+typedef struct Style Style;
+struct Style {
+    Colors unhighlighted, highlighted;
+};
+static Style ok_style = {
+    .unhighlighted = { .fg = black,         .bg = white },
+    .highlighted   = { .fg = bright(white), .bg = bright(blue) }
+};
+static Style oops_style = {
+    .unhighlighted = { .fg = black,         .bg = bright(cyan) },
+    .highlighted   = { .fg = bright(white), .bg = bright(red) }
+};
+static Colors border_colors = { .fg = blue, .bg = bright(yellow) };
+
+// In the costs view, formula cells get shaded by how their own time
+// compares with the costliest cell in view: under 1/8, 1/4, 1/2, more.
+static Style cost_styles[] = {
+    { .unhighlighted = { .fg = black, .bg = white },
+      .highlighted   = { .fg = bright(white), .bg = bright(blue) } },
+    { .unhighlighted = { .fg = black, .bg = bright(green) },
+      .highlighted   = { .fg = bright(white), .bg = green } },
+    { .unhighlighted = { .fg = black, .bg = bright(magenta) },
+      .highlighted   = { .fg = bright(white), .bg = magenta } },
+    { .unhighlighted = { .fg = black, .bg = bright(red) },
+      .highlighted   = { .fg = bright(white), .bg = red } },
+};
+static double max_cost;  // Among the cells in view.
+
+typedef enum { formulas, values, costs } View;
+
+// What show_at() drew of each cell lately, to draw again for as long as
+// nothing it came from changes: the cell's text, state and value, and
+// the view. (Costs change all the time, so they don't get kept.) It's
+// by row and column modulo powers of 2 at least the view's extent, so
+// that cells in view can't collide.
+typedef struct Drawn Drawn;
+struct Drawn {
+    unsigned row, col;
+    View view;
+    unsigned epoch;      // texts_epoch as of `text`; 0 if never drawn.
+    const Text *text;
+    unsigned char state;
+    Value value;         // Valid with valid_state, else 0.
+    const Style *style;
+    char chars[colwidth + 1];  // Fitted to the column.
+};
+
+static Drawn *drawn;     // malloced, drawn_rows x drawn_cols.
+static unsigned drawn_rows, drawn_cols;
+
+// Fit the table of Drawn to the view.
+static void size_drawn(unsigned rows, unsigned cols) {
+    unsigned m = 1, n = 1;
+    while (m < rows) m *= 2;
+    while (n < cols) n *= 2;
+    if (m == drawn_rows && n == drawn_cols) return;
+    free(drawn);
+    drawn = calloc(m * n, sizeof drawn[0]);
+    if (!drawn) panic("Out of memory");
+    drawn_rows = m;
+    drawn_cols = n;
+}
+
+// Put `text` into `fitted`, right-aligned in a column, cut short with
+// "..." if it's too wide.
+static void fit(char fitted[colwidth + 1], const char *text) {
+    if (strnlen(text, colwidth + 1) <= colwidth)
+        snprintf(fitted, colwidth + 1, "%*s", colwidth, text);
+    else {
+        memcpy(fitted, text, colwidth - 3);
+        strcpy(fitted + colwidth - 3, "...");
+    }
+}
+
+// For the cell at (r,c), show its content, formula, or cost according
+// to `view`, in style according to `highlighted`.
+static void show_at(unsigned r, unsigned c, View view, int highlighted) {
+    const Cell *cell = find_cell(r, c);
+    const Text *t = find_text(r, c);
+    const char *formula = t ? find_formula(t->chars) : NULL;
+    const Style *style = &ok_style;
+    char cost[colwidth + 1];
+    const char *fitted = cost;
+    if (view == costs && formula) {
+        Value value;
+        get_value(&value, r, c);  // (Bringing it up to date has a cost too.)
+        double share = 0 < max_cost ? cell->self_time / max_cost : 0;
+        style = &cost_styles[share < 1./8 ? 0 : share < 1./4 ? 1
+                             : share < 1./2 ? 2 : 3];
+        char text[64];
+        snprintf(text, sizeof text, "%ux %.3f ms",
+                 cell->evals, cell->self_time * 1e3);
+        fit(cost, text);
+    }
+    else {
+        Value value = 0;
+        if (view == values && formula) get_value(&value, r, c);
+        unsigned char state = get_state(r, c);
+        if (state != valid_state) value = 0;
+        Drawn *d = &drawn[(r & (drawn_rows-1)) * drawn_cols
+                          + (c & (drawn_cols-1))];
+        if (d->epoch != texts_epoch || d->row != r || d->col != c
+            || d->view != view || d->text != t || d->state != state
+            || memcmp(&d->value, &value, sizeof value)) {
+            *d = (Drawn) {
+                .row = r, .col = c, .view = view, .epoch = texts_epoch,
+                .text = t, .state = state, .value = value, .style = &ok_style
+            };
+            if (view != values || !formula)
+                fit(d->chars, orelse(formula, t ? t->chars : ""));
+            else if (state != valid_state) {
+                d->style = &oops_style;
+                fit(d->chars, plaints[state]);
+            }
+            else {
+                char number[32];
+                show_value(number, sizeof number, value, 6);
+                fit(d->chars, number);
+            }
+        }
+        style = d->style;
+        fitted = d->chars;
+    }
+    set_color(highlighted ? style->highlighted : style->unhighlighted);
+    draw_text(" ");
+    draw_text(fitted);
+}
+
+// The part of the sheet in view: its top-left cell and extent.
+static unsigned top_row, left_col, view_rows, view_cols;
+
+// Size the view to the screen and scroll it just far enough to show
+// the cursor. Return the width of the row labels.
+static int frame_view(unsigned cursor_row, unsigned cursor_col) {
+    size_screen();
+    view_rows = 3 < screen_height ? screen_height - 3 : 1;
+    if (cursor_row < top_row)
+        top_row = cursor_row;
+    else if (top_row + view_rows <= cursor_row)
+        top_row = cursor_row - view_rows + 1;
+    char label[16];
+    int label_width = max(2, snprintf(label, sizeof label, "%u",
+                                      top_row + view_rows - 1));
+    view_cols = max(1, ((int) screen_width - label_width) / (colwidth + 1));
+    if (cursor_col < left_col)
+        left_col = cursor_col;
+    else if (left_col + view_cols <= cursor_col)
+        left_col = cursor_col - view_cols + 1;
+    return label_width;
+}
+
+// Draw the cells in view; only they get recalculated, here.
+static void show(View view, unsigned cursor_row, unsigned cursor_col) {
+    double began = now();
+    int label_width = frame_view(cursor_row, cursor_col);
+    size_drawn(view_rows, view_cols);
+    if (view == costs) {
+        max_cost = 0;  // (Not counting what recalculating in this frame costs.)
+        for (unsigned r = top_row; r < top_row + view_rows; ++r)
+            for (unsigned c = left_col; c < left_col + view_cols; ++c) {
+                const Cell *cell = find_cell(r, c);
+                if (cell && max_cost < cell->self_time)
+                    max_cost = cell->self_time;
+            }
+    }
+    // Bring the formulas in view up to date a column at a time, for the
+    // sake of evaluate_run().
+    if (view != formulas)
+        for (unsigned c = left_col; c < left_col + view_cols; ++c)
+            for (unsigned r = top_row; r < top_row + view_rows; ++r) {
+                const Cell *cell = find_cell(r, c);
+                Value value;
+                if (cell && cell->code) get_value(&value, r, c);
+            }
+    move_pen(0, 0);
+    set_color(ok_style.unhighlighted);
+    draw("%s", get_text(cursor_row, cursor_col));
+    end_line();
+    set_color(border_colors);
+    draw("%s%*u",
+         view == formulas ? "(formulas)" : view == costs ? "(costs)   "
+                          : "          ",
+         (int) (label_width + 1 + colwidth - sizeof "(formulas)" + 1),
+         left_col);
+    for (unsigned c = left_col + 1; c < left_col + view_cols; ++c)
+        draw(" %*u", colwidth, c);
+    end_line();
+    for (unsigned r = top_row; r < top_row + view_rows; ++r) {
+        set_color(border_colors);
+        draw("%*u", label_width, r);
+        for (unsigned c = left_col; c < left_col + view_cols; ++c)
+            show_at(r, c, view, r == cursor_row && c == cursor_col);
+        end_line();
+    }
+    const Cell *focus = find_cell(cursor_row, cursor_col);
+    const char *focus_plaint = focus && focus->code
+        ? plaints[get_state(cursor_row, cursor_col)] : NULL;
+    if (focus_plaint == stale) focus_plaint = NULL; // `stale` here means not a formula cell
+    char summary[256];
+    if (view == costs) {
+        snprintf(summary, sizeof summary,
+                 "%ux %.3f/%.3f ms; edit: %lu evals, %lu refs;"
+                 " frame: %.3f ms, %zu bytes",
+                 focus ? focus->evals : 0,
+                 focus ? focus->self_time * 1e3 : 0,
+                 focus ? focus->total_time * 1e3 : 0,
+                 profile.evals, profile.refs,
+                 profile.frame_time * 1e3, profile.frame_bytes);
+        focus_plaint = summary;
+    }
+    move_pen(0, plaint_line);
+    draw("%s", orelse(the_plaint, orelse(focus_plaint, "")));
+    end_line();
+    flush_frame();
+    profile.frame_time = now() - began;
+}
+
+
+// Timing the engine, for ./bench
+
+static double started;
+static unsigned long allocations_at_start;
+
+static void start_timing(void) {
+    allocations_at_start = nallocations;
+    started = now();
+}
+
+static void report_timing(const char *what) {
+    double ms = (now() - started) * 1e3;
+    printf("%-8s %10.3f ms %10lu allocs\n",
+           what, ms, nallocations - allocations_at_start);
+}
+
+// Time the main operations on the sheet in `filename`: loading it,
+// recalculating it, editing cell r@c (to a new number) and
+// recalculating, saving it, and showing a frame -- those last two to
+// /dev/null. Pick an r@c that much of the sheet depends on.
+static int time_sheet(const char *filename, unsigned r, unsigned c) {
+    stuff(spreadsheet_filename, sizeof spreadsheet_filename, filename);
+    start_timing();
+    if (!read_file()) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    report_timing("read");
+    start_timing(); recalculate_all(); report_timing("recalc");
+
+    const char *text = strcmp(get_text(r, c), "=7") ? "=7" : "=8";
+    start_timing();
+    set_text(r, c, text);
+    recalculate_all();
+    report_timing("edit");
+
+    stuff(spreadsheet_filename, sizeof spreadsheet_filename, "/dev/null");
+    start_timing(); save_file(); report_timing("write");
+
+    fflush(stdout);
+    int terminal = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (terminal < 0 || null < 0) panic(strerror(errno));
+    dup2(null, STDOUT_FILENO);
+    start_timing(); show(values, 0, 0);
+    double ms = (now() - started) * 1e3;
+    unsigned long allocs = nallocations - allocations_at_start;
+    dup2(terminal, STDOUT_FILENO);
+    close(terminal); close(null);
+    printf("%-8s %10.3f ms %10lu allocs\n", "show", ms, allocs);
+    return 0;
+}
+
+
+// Main interaction loop and main program
 
 static View view = values;
 static int row = 0, col = 0;  // The cursor
 
 static void enter_text(void) {
-    stuff(input, sizeof input, cells[row][col].text);
+    stuff(input, sizeof input, get_text(row, col));
     if (edit_input())
         set_text(row, col, input);
     else
@@ -530,53 +5879,215 @@ static void enter_text(void) {
 }
 
 static void copy_text(unsigned r, unsigned c) {
-    set_text(r, c, cells[row][col].text);
+    set_text(r, c, get_text(row, col));
     row = r;
     col = c;
 }
 
+// Is the line from p to eol like "row col text", as in a file?
+static int is_record(const char *p, const char *eol) {
+    unsigned r, c;
+    const char *text = scan_record(p, eol, &r, &c);
+    return text && text < eol;
+}
+
+// Enter a pasted batch of cells, invalidating them all at once. It's
+// lines like "row col text", as in a file, if they all are and there
+// are no tabs; else a table of tab-separated texts, put at the cursor.
+static void paste(void) {
+    Buffer pasted = {0};
+    read_paste(&pasted);
+    const char *p = pasted.chars, *end = p + pasted.n;
+    int records = !memchr(p, '\t', pasted.n);
+    for (const char *line = p, *eol; records && line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        records = is_record(line, eol);
+    }
+    profile.evals = profile.refs = 0;
+    Addresses set = {0};
+    if (records)
+        load_sheet(p, pasted.n, 0, &set);
+    else {
+        unsigned r = row;
+        for (const char *line = p, *eol; line < end; line = eol + 1, ++r) {
+            eol = memchr(line, '\n', end - line);
+            if (!eol) eol = end;
+            unsigned c = col;
+            for (const char *field = line, *tab; field <= eol; field = tab + 1, ++c) {
+                tab = memchr(field, '\t', eol - field);
+                if (!tab) tab = eol;
+                if (max_rows <= r || max_cols <= c)
+                    oops("Pasted past the edge of the sheet");
+                else {
+                    set_bytes_only(r, c, field, tab - field);
+                    push_address(&set, r, c);
+                }
+            }
+        }
+    }
+    invalidate_cells(&set);
+    free(set.at);
+    free(pasted.chars);
+}
+
+// Undo the last step, or redo the last undone, showing where it was.
+static void take_back(int undoing) {
+    Address at = {row, col};
+    if (undoing ? !undo(&at) : !redo(&at))
+        oops(undoing ? "Nothing to undo" : "Nothing to redo");
+    else {
+        row = at.row;
+        col = at.col;
+    }
+}
+
 static void react(int key) {
     switch (key) {
     case ' ': enter_text(); break;
 
+    case 'u': take_back(1); break;
+    case 'U': take_back(0); break;
+
     case 'w': write_file(); break;
 
+    case key_paste: paste(); break;
+
+    case '\t': next_sheet(); break;
+
     case 'f': view = (view == formulas ? values : formulas); break;
 
-    case key_left:  col = max(col-1, 0);       break;
-    case key_right: col = min(col+1, ncols-1); break;
-    case key_down:  row = min(row+1, nrows-1); break;
-    case key_up:    row = max(row-1, 0);       break;
+    case 'p':
+        view = (view == costs ? values : costs);
+        profiling = 1;
+        break;
 
-    case key_ctrl|key_left:  copy_text(row,         max(col-1, 0));       break;
-    case key_ctrl|key_right: copy_text(row,         min(col+1, ncols-1)); break;
-    case key_ctrl|key_down:  copy_text(min(row+1, nrows-1), col);         break;
-    case key_ctrl|key_up:    copy_text(max(row-1, 0),       col);         break;
+    case key_left:  col = max(col-1, 0);          break;
+    case key_right: col = min(col+1, max_cols-1); break;
+    case key_down:  row = min(row+1, max_rows-1); break;
+    case key_up:    row = max(row-1, 0);          break;
+    case key_page_down: row = min(row+(int)view_rows, max_rows-1); break;
+    case key_page_up:   row = max(row-(int)view_rows, 0);          break;
+
+    case key_ctrl|key_left:  copy_text(row,         max(col-1, 0));          break;
+    case key_ctrl|key_right: copy_text(row,         min(col+1, max_cols-1)); break;
+    case key_ctrl|key_down:  copy_text(min(row+1, max_rows-1), col);         break;
+    case key_ctrl|key_up:    copy_text(max(row-1, 0),          col);         break;
 
     default: oops("Unknown key");
     }
 }
 
+// While the user's idle, bring the rest of the sheet up to date, a
+// slice at a time so a keystroke needn't wait long. (Plaints from off
+// the screen would only confuse, so drop them.)
+static void catch_up(void) {
+    const char *plaint = the_plaint;
+    while (!key_waiting(0) && recalculate_some(256))
+        ;
+    the_plaint = plaint;
+}
+
+// Is it a key that just moves the cursor?
+static int is_move(int key) {
+    return key == key_left || key == key_right || key == key_down
+        || key == key_up || key == key_page_down || key == key_page_up;
+}
+
+// Wait for a key, meanwhile tending to any writing in the background.
+static void await_key(void) {
+    while (!key_waiting(writer ? 100 : 1000))
+        if (tend_writer()) {
+            show(view, row, col);
+            the_plaint = NULL;
+        }
+}
+
 static void reactor_loop(void) {
     for (;;) {
         show(view, row, col);
         the_plaint = NULL;
+        catch_up();
+        if (tend_writer()) show(view, row, col);
+        await_key();
         int key = get_key();
         if (key == 'q') break;
         react(key);
+        end_step();
+        release_sheets();
+        // A burst of moves, as from holding an arrow key, gets one frame.
+        while (is_move(key) && is_move(peek_key()))
+            react(key = get_key());
     }
 }
 
+static void usage(void) {
+    panic("usage: vicissicalc [-P] [-j threads] [filename]\n"
+          "       vicissicalc -b [-c] [-P] [-j threads] [-p processes] filename...\n"
+          "       vicissicalc -s socket [-j threads] filename\n"
+          "       vicissicalc -t [-j threads] filename [row col]");
+}
+
 int main(int argc, char **argv) {
-    if (2 < argc) panic("usage: vicissicalc [filename]");
-    set_up();
-    if (argc == 2) {
-        stuff(spreadsheet_filename, sizeof spreadsheet_filename, argv[1]);
+    int batch_mode = 0, timing_mode = 0;
+    const char *server_path = NULL;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (0 == strcmp(argv[i], "-b"))
+            batch_mode = 1;
+        else if (0 == strcmp(argv[i], "-t"))
+            timing_mode = 1;
+        else if (0 == strcmp(argv[i], "-s") && i + 1 < argc)
+            server_path = argv[++i];
+        else if (0 == strcmp(argv[i], "-c"))
+            csv = 1;
+        else if (0 == strcmp(argv[i], "-P"))
+            profiling = 1;
+        else if (0 == strcmp(argv[i], "-j") && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+            if (nthreads < 1) usage();
+        }
+        else if (0 == strcmp(argv[i], "-p") && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 1) usage();
+            nprocesses = n;
+        }
+        else
+            usage();
+    }
+    if (batch_mode) {
+        if (i == argc) usage();
+        return batch(argc - i, argv + i);
+    }
+    if (timing_mode) {
+        if (csv || 1 < nprocesses || (i + 1 != argc && i + 3 != argc))
+            usage();
+        unsigned r = 0, c = 0;
+        if (i + 3 == argc
+            && (sscanf(argv[i+1], "%u", &r) != 1
+                || sscanf(argv[i+2], "%u", &c) != 1
+                || max_rows <= r || max_cols <= c))
+            usage();
+        if (1 < nthreads) start_workers();
+        return time_sheet(argv[i], r, c);
+    }
+    if (csv || 1 < nprocesses || i + 1 < argc) usage();
+    if (1 < nthreads) start_workers();
+    if (server_path) {
+        if (i == argc) usage();
+        return run_server(server_path, argv[i]);
+    }
+    if (i < argc) {
+        stuff(spreadsheet_filename, sizeof spreadsheet_filename, argv[i]);
         read_file();
     }
-    system("stty raw -echo");
-    printf(HIDE_CURSOR CLEAR_SCREEN);
+    check_unsaved();
+    raw_mode();
+    raw_terminal = 1;
+    printf(HIDE_CURSOR BRACKETED_PASTE_ON CLEAR_SCREEN);
+    keeping_history = 1;
     reactor_loop();
-    system("stty sane"); screen_reset();
-    return 0;
+    cooked_mode(); screen_reset();
+    raw_terminal = 0;
+    return finish_workbook();
 }